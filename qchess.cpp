@@ -1,18 +1,44 @@
-#include "chess.hpp"
+#include "qchess.hpp"
+#include "eval_weights.hpp"
 #include <cstring>
 #include <chrono>
 #include <string>
-#include <unordered_map>
 #include <format>
 #include <cmath>
+#include <numbers>
 #include <algorithm>
-#include <deque>
-#include <set>
 #include <vector>
 #include <thread>
-
-#define VERSION "QChess v3.0"
-#define AUTHOR "qwertyquerty"
+#include <atomic>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <sstream>
+#include <random>
+#include <fstream>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#if defined(NNUE_EMBED)
+#include "nnue_embedded.hpp"
+#endif
+
+// Build with -DHASH_SELF_CHECK to verify the incremental board hash against a
+// full zobrist() recomputation wherever the search uses it
+#ifdef HASH_SELF_CHECK
+#define CHECK_HASH(board) check_hash(board)
+#else
+#define CHECK_HASH(board)
+#endif
 
 enum pt_flag {
     UPPER = 0,
@@ -27,9 +53,40 @@ enum phase {
 
 #define N_SQUARES 64
 #define N_PLAYERS 2
+#define N_PHASES 2
 #define MAX_DEPTH 100
+#define MAX_PLY 256
 #define STARTING_DEPTH 1
 
+#define PERFT_TABLE_SIZE_MB 64
+
+#define STOP_CHECK_INTERVAL 1024
+
+#define TIME_DEFAULT_MOVESTOGO 30
+#define TIME_MAX_MOVESTOGO 50
+#define TIME_MAXIMUM_FRACTION 0.8
+#define TIME_MAXIMUM_SCALE 5
+#define TIME_MAX_BRANCHING_FACTOR 4.0
+#define TIME_SCORE_DROP_LIMIT 100
+#define TIME_STABILITY_LEVELS 5
+
+// Optimum time scale by how many iterations in a row kept the same best move
+static const double TIME_STABILITY_SCALES[TIME_STABILITY_LEVELS] = {2.0, 1.4, 1.1, 0.9, 0.8};
+
+#define NNUE_INPUT_SIZE 768
+#define NNUE_HIDDEN_SIZE 256
+#define NNUE_QA 255
+#define NNUE_QB 64
+#define NNUE_SCALE 400
+#define NNUE_MAX_SCORE 30000
+
+#define DATAGEN_RANDOM_PLIES 8
+#define DATAGEN_MAX_PLIES 400
+#define DATAGEN_ADJUDICATE_SCORE 2000
+#define DATAGEN_ADJUDICATE_PLIES 4
+#define DATAGEN_BUFFER_RECORDS 16384
+#define DATAGEN_REPORT_INTERVAL_MS 10000
+
 #define QUIESCENCE_CHECK_DEPTH_LIMIT 3
 
 #define ASPIRATION_WINDOW_DEFAULT 25
@@ -77,15 +134,6 @@ int8_t LATE_MOVE_REDUCTION_TABLE[LATE_MOVE_REDUCTION_TABLE_SIZE][LATE_MOVE_REDUC
     {0,1,1,1,1,1,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,3,3,3,3,3}
 };
 
-int8_t DOUBLED_PAWN_PENALTY[2] = {-10, -30};
-int8_t TRIPLED_PAWN_PENALTY[2] = {-12, -37};
-int8_t ISOLATED_PAWN_PENALTY[2] = {-25, -5};
-uint8_t PASSED_PAWN_BONUS[2] = {0, 50};
-int8_t DOUBLE_BISHOP_BONUS[2] = {34, 55};
-
-int8_t OPEN_FILE_NEAR_KING_PENALTY[2] = {-30, 0};
-
-int8_t TEMPO_BONUS[2] = {20, 0};
 
 #define MAX_HISTORY_VALUE 10000
 #define HISTORY_SHRINK_FACTOR 2
@@ -94,7 +142,13 @@ int8_t TEMPO_BONUS[2] = {20, 0};
 
 #define MAX_KILLER_MOVES 4
 
-#define MAX_PTABLE_SIZE 200'000'000
+#define PAWN_TABLE_SIZE 16384
+
+#define PTABLE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define PTABLE_BUCKET_SLOTS 4
+#define PTABLE_AGE_BITS 6
+#define PTABLE_AGE_WEIGHT 8
+#define PTABLE_HASHFULL_SAMPLES 1000
 
 #define CHECKMATE_SCORE 100000
 #define SCORE_NONE 200000
@@ -111,64 +165,11 @@ static const uint16_t REVERSE_FUTILITY_MARGINS[8] = {0, 70, 150, 240, 340, 450,
 
 static const int16_t CP_PIECE_VALUES[7] = {100, 300, 300, 500, 900, 0, 0};
 
-static const int16_t PHASED_CP_PIECE_VALUES[2][7] = {
-    {77, 319, 327, 496, 985, 0, 0}, // midgame
-    {101, 330, 335, 499, 999, 0, 0} // endgame
-};
 
-static const int16_t PIECE_POSITION_TABLES[6][2][64] = {
-    { // Pawn	
-        {0, 0, 0, 0, 0, 0, 0, 0, -19, -18, -15, -20, -6, 16, 27, -7, -19, -15, -9, -12, -2, 2, 23, 4, -24, -18, -9, 8, 3, 8, 4, -10, -16, -12, -2, 5, 27, 24, 19, 4, 18, 11, 31, 46, 51, 77, 56, 32, 96, 105, 72, 106, 65, 68, -21, -21, 0, 0, 0, 0, 0, 0, 0, 0},
-        {0, 0, 0, 0, 0, 0, 0, 0, 17, 30, 19, 32, 31, 21, 14, 4, 12, 23, 12, 24, 23, 18, 14, 0, 23, 29, 13, 5, 7, 10, 16, 6, 49, 50, 31, 18, 12, 19, 35, 29, 115, 138, 110, 81, 67, 65, 114, 100, 178, 170, 179, 144, 154, 128, 186, 193, 0, 0, 0, 0, 0, 0, 0, 0}
-    },
-    { // Knight
-        {-80, -40, -33, -27, -20, -19, -43, -52, -45, -35, -22, -10, -10, -1, -21, -20, -36, -17, 0, 13, 21, 2, 0, -24, -23, -8, 11, 16, 23, 15, 16, -9, -5, -1, 24, 50, 24, 52, 8, 19, -15, 29, 59, 70, 75, 70, 50, -7, -51, 1, 29, 31, 25, 60, 31, 20, -110, -100, -39, -32, -26, -80, -80, -110},
-        {-37, -22, -11, -1, -8, -17, -6, -21, -14, -4, 4, 6, 6, 0, -20, -11, -18, 1, 5, 18, 21, 4, -1, -15, 7, 12, 27, 20, 27, 17, 5, -4, -9, 14, 27, 24, 21, 19, 13, -3, 4, -1, 13, 10, 11, 1, -13, -14, -9, -6, -11, -4, -11, 2, -28, -19, -88, -38, -17, -23, -8, -26, -19, -89}
-    },
-    { // Bishop
-        {-8, 14, -7, -2, -3, -12, 18, 0, 2, 5, 16, -8, 5, 14, 17, 1, -2, 4, 7, 7, 10, 8, 5, 10, -18, -15, -4, 26, 17, 0, 0, 2, -13, 0, 16, 34, 27, 26, 4, -4, -10, 19, 26, 21, 15, 45, 49, 21, -21, 16, 2, -7, 16, 9, 20, -5, -4, -70, -9, -70, -70, -70, -46, -43},
-        {-17, 0, 5, -9, -5, 10, -12, -22, -13, -11, -16, 4, -4, -3, -3, -10, -5, -7, 1, -2, 6, 2, 0, -14, -12, 3, 4, -3, 7, -4, -5, -32, -12, -6, 3, 4, -4, -1, -4, -13, -3, -8, -11, -12, -18, -12, -12, -10, -13, -11, -20, -9, -30, -20, -9, -25, -4, -2, -14, -9, -19, -16, -11, -18}
-    },
-    { // Rook
-        {-16, -13, -6, 7, 6, 5, 4, -17, -35, -18, -17, -13, -11, 2, 9, -22, -25, -25, -23, -17, -8, -15, 9, -3, -28, -26, -11, -15, -8, -24, -10, -21, -21, 3, -10, 2, 1, 8, 8, 2, -6, 14, 11, 4, 31, 33, 64, 34, -9, 1, 4, 15, -1, 36, 24, 16, -18, -4, 13, -13, -5, 6, 32, 28},
-        {9, 7, 6, 4, -3, -1, -6, -3, 3, -1, 5, 3, -4, -12, -10, -8, 5, 6, 5, 2, -4, -12, -17, -19, 6, 8, 13, 14, 2, 1, 3, 2, 16, 8, 17, 12, -5, -6, 2, -6, 14, 11, 7, 12, -6, -4, 2, 1, 20, 21, 26, 12, 11, 9, 4, 16, 29, 11, 21, 20, 18, 16, 8, 12}
-    },
-    { // Queen
-        {-2, -7, 0, 6, 4, -3, -5, -6, -7, -4, 6, 11, 10, 18, 6, 26, -12, -5, -1, -6, -6, 2, 0, -3, -12, -10, -13, -12, -12, -9, 0, -4, -18, -6, -11, -20, 1, 1, 4, 9, -1, -14, 0, -15, 12, 44, 60, 35, -17, -18, -3, -8, 9, 13, 11, 51, -34, -19, -8, -22, 3, 19, 45, 8},
-        {-11, -12, -16, 10, -5, -19, -22, -16, -15, -16, -12, -2, 3, -21, -19, -68, -3, 2, 7, 10, 25, 5, 12, 20, -5, -3, 5, 34, 31, 26, 7, 31, 14, 11, 10, 35, 27, 42, 33, 15, 6, 21, 34, 36, 34, 41, 0, 40, 16, 10, 34, 44, 56, 26, 19, 27, 15, -6, 17, 45, 21, 21, -3, 20}
-    },
-    { // King
-        {33, 59, 32, -40, 6, -25, 42, 39, 51, 17, 4, -27, -27, -18, 20, 30, -18, 3, -27, -43, -31, -43, -16, -43, -23, -26, -41, -54, -67, -22, -28, -56, -13, -14, -34, -53, -49, -25, -12, -20, -36, 0, -30, -30, -23, 0, 0, 1, -37, -13, -42, -13, -26, -5, 0, 10, -51, -37, -29, -43, -34, -4, 0, -29},
-        {-82, -60, -43, -33, -44, -32, -55, -86, -47, -23, -11, -2, 3, -2, -20, -40, -34, -11, 9, 24, 23, 18, -2, -17, -34, 2, 29, 43, 46, 30, 11, -7, -17, 15, 33, 42, 45, 43, 26, -4, -10, 10, 35, 40, 46, 53, 30, 2, -25, 4, 10, 16, 22, 27, 20, -7, -84, -46, -28, -6, -23, -11, 0, -90}
-    }
-};
+static const int16_t PHASE_PIECE_WEIGHTS[7] = {1, 10, 10, 20, 40, 0, 0};
+#define PHASE_TOTAL 256
+
 
-static const int8_t PIECE_MOBILITY_TABLES[6][2][28] = {
-    { // Pawn
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-        {0, -5, -5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
-    },
-    { // Knight
-        {-21, -6, 2, 5, 9, 11, 11, 11, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-        {-21, -6, 2, 5, 9, 11, 11, 11, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
-    },
-    { // Bishop
-        {-45, -34, -22, -16, -7, 3, 9, 13, 16, 14, 14, 16, 16, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-        {-45, -34, -22, -16, -7, 3, 9, 13, 16, 14, 14, 16, 16, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
-    },
-    { // Rook
-        {-29, -16, -12, -6, -4, 1, 4, 6, 9, 13, 13, 14, 16, 17, 17, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-        {-29, -16, -12, -6, -4, 1, 4, 6, 9, 13, 13, 14, 16, 17, 17, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
-    },
-    { // Queen
-        {-55, -80, -39, -37, -44, -33, -14, -29, -13, -17, 2, -4, 2, 15, 20, 27, 22, 42, 47, 48, 51, 51, 54, 47, 50, 56, 46, 75},
-        {-20, -11, -31, -21, -19, -14, -10, -9, -5, -2, -2, 0, 3, -1, 3, 4, 3, 2, 6, 16, 25, 25, 19, 33, 28, 37, 20, 78}
-    },
-    { // King
-        {-20, -5, 0, 0, 0, -5, -10, -20, -20, -20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-        {-50, -40, -30, -20, -10, 0, 10, 20, 20, 20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
-    },
-};
 
 chess::Bitboard PASSING_FIELDS[2][64] = {0};
 void generate_passing_fields() {
@@ -185,789 +186,3328 @@ void generate_passing_fields() {
     }
 }
 
-static bool stop = true;
-static uint64_t nodes = 0;
-static int32_t movetime = 0;
-static int32_t wtime = 0;
-static int32_t btime = 0;
-static int32_t winc = 0;
-static int32_t binc = 0;
-static int64_t search_start_time = 0;
-static std::deque<chess::Move> killer_moves[MAX_DEPTH];
-static chess::Move countermove_table[N_SQUARES][N_SQUARES] = {0};
-static uint16_t history_table[N_PLAYERS][N_SQUARES][N_SQUARES] = {0};
-static uint16_t seldepth = 0;
-static chess::Board board = chess::Board(chess::constants::STARTPOS);
-
-struct position_table_entry {
-    int32_t value;
-    chess::Move best_move;
-    pt_flag flag;
-    int8_t leaf_distance;
-};
+// Zobrist keys for pawns only, chess::Zobrist keeps its tables private
+uint64_t PAWN_KEYS[2][64] = {0};
+void generate_pawn_keys() {
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
 
-std::unordered_map<uint64_t, position_table_entry> position_table;
-
-void shrink_history(uint16_t table[N_PLAYERS][N_SQUARES][N_SQUARES]) {
-    for (int i = 0; i < N_PLAYERS; i++) {
-        for (int j = 0; j < N_SQUARES; j++) {
-            for (int k = 0; k < N_SQUARES; k++) {
-                table[i][j][k] /= HISTORY_SHRINK_FACTOR;
-            }
+    for (uint8_t color = 0; color < 2; color++) {
+        for (uint8_t square = 0; square < 64; square++) {
+            // splitmix64
+            uint64_t key = (seed += 0x9E3779B97F4A7C15ULL);
+            key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+            PAWN_KEYS[color][square] = key ^ (key >> 31);
         }
     }
 }
 
-constexpr inline int32_t lerp(int32_t start, int32_t end, float position) {
-    return (int32_t)((1-position) * (float)start + position * (float)end);
+void initialize_tables() {
+    static std::once_flag initialized;
+
+    std::call_once(initialized, []() {
+        generate_passing_fields();
+        generate_pawn_keys();
+    });
 }
 
-float game_phase(const chess::Board& board) {
-    int16_t remaining = 0;
-    remaining += board.pieces(chess::PieceType::PAWN).count();
-    remaining += board.pieces(chess::PieceType::KNIGHT).count() * 10;
-    remaining += board.pieces(chess::PieceType::BISHOP).count() * 10;
-    remaining += board.pieces(chess::PieceType::ROOK).count() * 20;
-    remaining += board.pieces(chess::PieceType::QUEEN).count() * 40;
+// Material and piece-square sums from white's point of view, kept per ply by the
+// search so static eval doesn't have to rescan the board.
+struct eval_accumulator {
+    int32_t position[N_PHASES];
+    int32_t material[N_PHASES];
+    int16_t phase_material;
+    uint64_t pawn_key;
+};
 
-    return std::max(0.0f, std::min(1.0f, (256.0f-(float)remaining)/256.0f));
-}
+void accumulator_add_piece(eval_accumulator& accumulator, chess::Piece piece, chess::Square square, int8_t sign = 1) {
+    chess::PieceType type = piece.type();
+    chess::Square pov_square = square.relative_square(piece.color());
+    int32_t color_mod = COLOR_MOD[piece.color()] * sign;
+    int32_t push = (uint8_t)pov_square.rank() * WILL_TO_PUSH;
 
-bool is_quiet_move(const chess::Board& board, chess::Move move, int8_t quiescence_depth = 0) {
-    if (board.isCapture(move)) {
-        return false;
+    for (uint8_t phase = 0; phase < N_PHASES; phase++) {
+        accumulator.position[phase] += (PIECE_POSITION_TABLES[type][phase][pov_square.index()] + push) * color_mod;
+        accumulator.material[phase] += PHASED_CP_PIECE_VALUES[phase][type] * color_mod;
     }
 
-    if ((quiescence_depth <= QUIESCENCE_CHECK_DEPTH_LIMIT) && ((board.givesCheck(move) != chess::CheckType::NO_CHECK) || board.inCheck())) {
-        return false;
-    }
+    accumulator.phase_material += PHASE_PIECE_WEIGHTS[type] * sign;
 
-    if (move.typeOf() == chess::Move::PROMOTION) {
-        return false;
+    if (type == chess::PieceType::PAWN) {
+        accumulator.pawn_key ^= PAWN_KEYS[piece.color()][square.index()];
     }
+}
 
-    return true;
+void accumulator_remove_piece(eval_accumulator& accumulator, chess::Piece piece, chess::Square square) {
+    accumulator_add_piece(accumulator, piece, square, -1);
 }
 
-int32_t score_move(const chess::Board& board, chess::Move move, std::vector<chess::Move>& move_stack, int8_t level, float phase, chess::Move pt_best_move = chess::Move::NO_MOVE) {
-    if (move == pt_best_move) {
-        return 30000;
-    }
+void refresh_accumulator(eval_accumulator& accumulator, const chess::Board& board) {
+    accumulator = {};
 
-    // Pawn promotion
-    if (move.typeOf() == chess::Move::PROMOTION) {
-        return 29000;
-    }
+    chess::Bitboard occupied = board.occ();
 
-    // Pawn about to promote
-    chess::Piece attacker = board.at(move.from());
-    if (attacker.type() == chess::PieceType::PAWN && (move.to().rank() == chess::Rank::RANK_2 || move.to().rank() == chess::Rank::RANK_7)) {
-        return 28000;
+    while (occupied) {
+        chess::Square square = occupied.pop();
+        accumulator_add_piece(accumulator, board.at(square), square);
     }
+}
 
-    // MVV - LVA
-    chess::Piece victim = board.at(move.to());
-    if (victim != chess::Piece::NONE) {
-        return 27000 + CP_PIECE_VALUES[victim.type()] - CP_PIECE_VALUES[attacker.type()];
+// Pieces a move takes off the board and puts on it, listed before the move is made
+struct piece_changes {
+    chess::Piece removed_pieces[2];
+    chess::Square removed_squares[2];
+    uint8_t removed_count = 0;
+    chess::Piece added_pieces[2];
+    chess::Square added_squares[2];
+    uint8_t added_count = 0;
+
+    void remove(chess::Piece piece, chess::Square square) {
+        removed_pieces[removed_count] = piece;
+        removed_squares[removed_count++] = square;
     }
 
-    // Killer move heuristic
-    uint8_t km_idx = 0;
-    for (chess::Move km : killer_moves[level]) {
-        if (move == km) {
-            return 26000 - km_idx;
-        }
-        km_idx++;
+    void add(chess::Piece piece, chess::Square square) {
+        added_pieces[added_count] = piece;
+        added_squares[added_count++] = square;
     }
+};
 
-    // Countermove heuristic
-    if (move_stack.size() >= 2 && move == countermove_table[move_stack[-2].from().index()][move_stack[-2].to().index()]) {
-        return 25000;
-    }
+piece_changes move_piece_changes(const chess::Board& board, chess::Move move) {
+    piece_changes changes;
 
-    // Take last moved piece
-    if (move_stack.size() > 0 && move_stack[move_stack.size()-1] != chess::Move::NULL_MOVE && move_stack[move_stack.size()-1].to().index() == move.to().index()) {
-        return 24000;
+    chess::Color side = board.sideToMove();
+    chess::Piece piece = board.at(move.from());
+
+    if (move.typeOf() == chess::Move::CASTLING) {
+        bool king_side = move.to() > move.from();
+        chess::Piece rook = board.at(move.to());
+
+        changes.remove(piece, move.from());
+        changes.remove(rook, move.to());
+        changes.add(piece, chess::Square::castling_king_square(king_side, side));
+        changes.add(rook, chess::Square::castling_rook_square(king_side, side));
+        return changes;
     }
 
-    // Checks
-    if (board.givesCheck(move) != chess::CheckType::NO_CHECK) {
-        return 23000;
+    if (move.typeOf() == chess::Move::ENPASSANT) {
+        changes.remove(chess::Piece(chess::PieceType::PAWN, ~side), move.to().ep_square());
+    }
+    else if (board.at(move.to()) != chess::Piece::NONE) {
+        changes.remove(board.at(move.to()), move.to());
     }
 
-    // History heuristic
-    int32_t score = history_table[board.sideToMove()][move.from().index()][move.to().index()];
+    changes.remove(piece, move.from());
 
-    return score;
+    if (move.typeOf() == chess::Move::PROMOTION) {
+        changes.add(chess::Piece(move.promotionType(), side), move.to());
+    }
+    else {
+        changes.add(piece, move.to());
+    }
+
+    return changes;
 }
 
-void sort_moves(chess::Movelist& moves, chess::Board& board, std::vector<chess::Move>& move_stack, int8_t level, const chess::Move pt_best_move = chess::Move::NO_MOVE) {
-    float phase = game_phase(board);
+// Derives the accumulator after a move from the one before it
+void update_accumulator(const eval_accumulator& from, eval_accumulator& to, const piece_changes& changes) {
+    to = from;
 
-    for (chess::Move& move : moves) {
-        move.setScore(score_move(board, move, move_stack, level, phase, pt_best_move));
+    for (uint8_t i = 0; i < changes.removed_count; i++) {
+        accumulator_remove_piece(to, changes.removed_pieces[i], changes.removed_squares[i]);
     }
 
-    std::sort(moves.begin(), moves.end(), [](const auto& lhs, const auto& rhs) {
-        return lhs.score() > rhs.score();
-    });
+    for (uint8_t i = 0; i < changes.added_count; i++) {
+        accumulator_add_piece(to, changes.added_pieces[i], changes.added_squares[i]);
+    }
 }
 
-int32_t score_board(chess::Board& board) {
-    if (board.isRepetition(2) || board.isHalfMoveDraw() || board.isInsufficientMaterial() || board.isGameOver().first == chess::GameResultReason::STALEMATE) {
-        return 0;
+// 768 -> NNUE_HIDDEN_SIZE x2 -> 1 network. Each side has an accumulator of the first layer
+// over its own view of the board (colour, piece type, square, flipped for black), and the
+// output layer reads both clipped to [0, NNUE_QA], side to move first.
+//
+// Network files are little endian int16 in the order feature weights [768][hidden], feature
+// biases [hidden], output weights [2 * hidden] and the output bias, optionally zero padded
+// to a multiple of 64 bytes. Build with -DNNUE_EMBED and a nnue_embedded.hpp made with
+// `xxd -i -n nnue_embedded_net <file> > nnue_embedded.hpp` to compile a network in.
+struct nnue_network {
+    alignas(64) int16_t feature_weights[NNUE_INPUT_SIZE][NNUE_HIDDEN_SIZE];
+    alignas(64) int16_t feature_biases[NNUE_HIDDEN_SIZE];
+    alignas(64) int16_t output_weights[N_PLAYERS][NNUE_HIDDEN_SIZE];
+    int16_t output_bias;
+};
+
+#define NNUE_FILE_SIZE ((NNUE_INPUT_SIZE * NNUE_HIDDEN_SIZE + NNUE_HIDDEN_SIZE + N_PLAYERS * NNUE_HIDDEN_SIZE + 1) * sizeof(int16_t))
+
+struct nnue_accumulator {
+    alignas(64) int16_t values[N_PLAYERS][NNUE_HIDDEN_SIZE];
+};
+
+std::shared_ptr<const nnue_network> load_network(const char* data, size_t size) {
+    if (size < NNUE_FILE_SIZE || size > (NNUE_FILE_SIZE + 63) / 64 * 64) {
+        return nullptr;
     }
-    
-    int32_t score = 0;
 
-    float phase = game_phase(board);
+    std::shared_ptr<nnue_network> network = std::make_shared<nnue_network>();
 
-    uint8_t pawn_file_counts[2][8] = {{0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0}};
+    memcpy(network->feature_weights, data, sizeof(network->feature_weights));
+    data += sizeof(network->feature_weights);
+    memcpy(network->feature_biases, data, sizeof(network->feature_biases));
+    data += sizeof(network->feature_biases);
+    memcpy(network->output_weights, data, sizeof(network->output_weights));
+    data += sizeof(network->output_weights);
+    memcpy(&network->output_bias, data, sizeof(network->output_bias));
 
-    for (uint8_t square = 0; square < N_SQUARES; square++) {
-        chess::Piece piece = board.at(square);
+    return network;
+}
 
-        if (piece != chess::Piece::NONE) {
-            chess::Square pov_square = chess::Square(square).relative_square(piece.color());
+std::shared_ptr<const nnue_network> load_network_file(const std::string& path) {
+    std::ifstream input(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
 
-            int8_t color_mod = COLOR_MOD[piece.color()];
+    return input ? load_network(data.data(), data.size()) : nullptr;
+}
 
-            score += lerp(
-                PIECE_POSITION_TABLES[piece.type()][MIDGAME][pov_square.index()],
-                PIECE_POSITION_TABLES[piece.type()][ENDGAME][pov_square.index()],
-                phase
-            ) * color_mod;
+// The network compiled into the binary, if any
+std::shared_ptr<const nnue_network> embedded_network() {
+#if defined(NNUE_EMBED)
+    static std::shared_ptr<const nnue_network> network = load_network((const char*)nnue_embedded_net, nnue_embedded_net_len);
+    return network;
+#else
+    return nullptr;
+#endif
+}
 
-            score += (uint8_t)pov_square.rank() * WILL_TO_PUSH * color_mod;
+inline uint16_t nnue_feature(chess::Color perspective, chess::Piece piece, chess::Square square) {
+    uint16_t side = piece.color() == perspective ? 0 : 6;
+    return (side + (uint8_t)piece.type()) * N_SQUARES + square.relative_square(perspective).index();
+}
 
-            score += lerp(
-                PHASED_CP_PIECE_VALUES[MIDGAME][piece.type()],
-                PHASED_CP_PIECE_VALUES[ENDGAME][piece.type()],
-                phase
-            ) * color_mod * (1 + (phase/2.0)); // pieces value matters more in late game
+// to = from + the added rows - the removed rows, in one pass over the accumulator
+void nnue_update_rows(const int16_t* from, int16_t* to, const int16_t* const* added, uint8_t added_count, const int16_t* const* removed, uint8_t removed_count) {
+#if defined(__AVX2__)
+    for (uint16_t i = 0; i < NNUE_HIDDEN_SIZE; i += 16) {
+        __m256i values = _mm256_load_si256((const __m256i*)(from + i));
 
-            if (piece.type() == chess::PieceType::PAWN) {
-                pawn_file_counts[piece.color()][pov_square.file()]++;
+        for (uint8_t j = 0; j < added_count; j++) {
+            values = _mm256_add_epi16(values, _mm256_load_si256((const __m256i*)(added[j] + i)));
+        }
 
-                if ((uint8_t)pov_square.file() < 7) {
-                    if ((PASSING_FIELDS[piece.color()][square] & board.pieces(chess::PieceType::PAWN, ~piece.color())).empty()) {
-                        score += lerp(PASSED_PAWN_BONUS[MIDGAME], PASSED_PAWN_BONUS[ENDGAME], phase) * color_mod;
-                    }
-                }
-            }
+        for (uint8_t j = 0; j < removed_count; j++) {
+            values = _mm256_sub_epi16(values, _mm256_load_si256((const __m256i*)(removed[j] + i)));
         }
-    }
 
-    chess::Movelist mobility_moves;
+        _mm256_store_si256((__m256i*)(to + i), values);
+    }
+#elif defined(__SSE4_1__)
+    for (uint16_t i = 0; i < NNUE_HIDDEN_SIZE; i += 8) {
+        __m128i values = _mm_load_si128((const __m128i*)(from + i));
 
-    for (int side = 0; side < 2; side++) {
-        uint8_t piece_gen_type = 1;
-        for (uint8_t piece = 0; piece < 6; piece++) {
-            chess::movegen::legalmoves(mobility_moves, board, piece_gen_type);
-            uint8_t move_count = mobility_moves.size();
+        for (uint8_t j = 0; j < added_count; j++) {
+            values = _mm_add_epi16(values, _mm_load_si128((const __m128i*)(added[j] + i)));
+        }
 
-            score += lerp(PIECE_MOBILITY_TABLES[piece][MIDGAME][move_count], PIECE_MOBILITY_TABLES[piece][ENDGAME][move_count], phase) * COLOR_MOD[side];
-            mobility_moves.clear();
-            piece_gen_type *= 2;
+        for (uint8_t j = 0; j < removed_count; j++) {
+            values = _mm_sub_epi16(values, _mm_load_si128((const __m128i*)(removed[j] + i)));
         }
 
-        if (side == 0) {board.makeNullMove();}
-        else {board.unmakeNullMove();}
+        _mm_store_si128((__m128i*)(to + i), values);
     }
+#else
+    for (uint16_t i = 0; i < NNUE_HIDDEN_SIZE; i++) {
+        int16_t value = from[i];
 
-    int8_t dbb = lerp(DOUBLE_BISHOP_BONUS[MIDGAME], DOUBLE_BISHOP_BONUS[ENDGAME], phase);
+        for (uint8_t j = 0; j < added_count; j++) {
+            value += added[j][i];
+        }
 
-    if (board.pieces(chess::PieceType::BISHOP, chess::Color::WHITE).count() == 2) {
-        score += dbb;
-    };
+        for (uint8_t j = 0; j < removed_count; j++) {
+            value -= removed[j][i];
+        }
 
-    if (board.pieces(chess::PieceType::BISHOP, chess::Color::BLACK).count() == 2) {
-        score -= dbb;
+        to[i] = value;
     }
+#endif
+}
 
-    const int8_t dpp = lerp(DOUBLED_PAWN_PENALTY[MIDGAME], DOUBLED_PAWN_PENALTY[ENDGAME], phase);
-    const int8_t tpp = lerp(TRIPLED_PAWN_PENALTY[MIDGAME], TRIPLED_PAWN_PENALTY[ENDGAME], phase);
-    const int8_t ipp = lerp(ISOLATED_PAWN_PENALTY[MIDGAME], ISOLATED_PAWN_PENALTY[ENDGAME], phase);
+void refresh_nnue_accumulator(const nnue_network& network, nnue_accumulator& accumulator, const chess::Board& board) {
+    for (uint8_t perspective = 0; perspective < N_PLAYERS; perspective++) {
+        memcpy(accumulator.values[perspective], network.feature_biases, sizeof(network.feature_biases));
 
-    for (uint8_t file = 0; file < 8; file++) {
-        score += (pawn_file_counts[(int8_t)chess::Color::WHITE][file] == 2 ? dpp : 0);
-        score -= (pawn_file_counts[(int8_t)chess::Color::BLACK][file] == 2 ? dpp : 0);
-        score += (pawn_file_counts[(int8_t)chess::Color::WHITE][file] >= 3 ? tpp : 0);
-        score -= (pawn_file_counts[(int8_t)chess::Color::BLACK][file] >= 3 ? tpp : 0);
+        chess::Bitboard occupied = board.occ();
 
-        if (
-            pawn_file_counts[(int8_t)chess::Color::WHITE][file] > 0 && 
-            (file == 0 || pawn_file_counts[(int8_t)chess::Color::WHITE][file-1] == 0) &&
-            (file == 7 || pawn_file_counts[(int8_t)chess::Color::WHITE][file+1] == 0)
-        ) {
-            score += ipp;
-        }
+        while (occupied) {
+            chess::Square square = occupied.pop();
+            const int16_t* row = network.feature_weights[nnue_feature(chess::Color(perspective), board.at(square), square)];
 
-        if (
-            pawn_file_counts[(int8_t)chess::Color::BLACK][file] > 0 && 
-            (file == 0 || pawn_file_counts[(int8_t)chess::Color::BLACK][file-1] == 0) &&
-            (file == 7 || pawn_file_counts[(int8_t)chess::Color::BLACK][file+1] == 0)
-        ) {
-            score -= ipp;
+            nnue_update_rows(accumulator.values[perspective], accumulator.values[perspective], &row, 1, nullptr, 0);
         }
     }
+}
 
-    const int8_t ofnkp = lerp(OPEN_FILE_NEAR_KING_PENALTY[MIDGAME], OPEN_FILE_NEAR_KING_PENALTY[ENDGAME], phase);
-    const int8_t white_king_file = chess::Square(board.pieces(chess::PieceType::KING, chess::Color::WHITE).lsb()).file();
-    const int8_t black_king_file = chess::Square(board.pieces(chess::PieceType::KING, chess::Color::WHITE).lsb()).file();
+void update_nnue_accumulator(const nnue_network& network, const nnue_accumulator& from, nnue_accumulator& to, const piece_changes& changes) {
+    for (uint8_t perspective = 0; perspective < N_PLAYERS; perspective++) {
+        const int16_t* added[2];
+        const int16_t* removed[2];
 
-    #pragma unroll
-    for (int8_t file = std::max(white_king_file-1, 0); file < std::min(white_king_file+1, 7); file++) {
-        if (pawn_file_counts[(int8_t)chess::Color::WHITE][file] == 0) {
-            score += ofnkp;
+        for (uint8_t i = 0; i < changes.added_count; i++) {
+            added[i] = network.feature_weights[nnue_feature(chess::Color(perspective), changes.added_pieces[i], changes.added_squares[i])];
         }
-    }
 
-    #pragma unroll
-    for (int8_t file = std::max(black_king_file-1, 0); file < std::min(black_king_file+1, 7); file++) {
-        if (pawn_file_counts[(int8_t)chess::Color::BLACK][file] == 0) {
-            score -= ofnkp;
+        for (uint8_t i = 0; i < changes.removed_count; i++) {
+            removed[i] = network.feature_weights[nnue_feature(chess::Color(perspective), changes.removed_pieces[i], changes.removed_squares[i])];
         }
-    }
 
-    score *= COLOR_MOD[board.sideToMove()];
-
-    score += lerp(TEMPO_BONUS[MIDGAME], TEMPO_BONUS[ENDGAME], phase);
-
-    return score;
+        nnue_update_rows(from.values[perspective], to.values[perspective], added, changes.added_count, removed, changes.removed_count);
+    }
 }
 
+// Sum of clipped accumulator values times the output weights
+int32_t nnue_output_sum(const int16_t* values, const int16_t* weights) {
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ceiling = _mm256_set1_epi16(NNUE_QA);
+    __m256i sum = _mm256_setzero_si256();
 
-void generate_pv_line(chess::Movelist& pv_line, chess::Board& board) {
-    chess::Board nboard = board;
+    for (uint16_t i = 0; i < NNUE_HIDDEN_SIZE; i += 16) {
+        __m256i clipped = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i*)(values + i)), zero), ceiling);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(clipped, _mm256_load_si256((const __m256i*)(weights + i))));
+    }
 
-    uint64_t zh = board.zobrist();
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
 
-    std::set<uint64_t> hashes;
-    hashes.clear();
+    return _mm_cvtsi128_si32(half);
+#elif defined(__SSE4_1__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ceiling = _mm_set1_epi16(NNUE_QA);
+    __m128i sum = _mm_setzero_si128();
 
-    while (position_table.count(zh) && (hashes.find(zh) == hashes.end())) {
-        if (position_table[zh].best_move != chess::Move::NO_MOVE && nboard.isGameOver().second == chess::GameResult::NONE && position_table[zh].flag == pt_flag::EXACT) {
-            chess::Move pv_move = position_table[zh].best_move;
+    for (uint16_t i = 0; i < NNUE_HIDDEN_SIZE; i += 8) {
+        __m128i clipped = _mm_min_epi16(_mm_max_epi16(_mm_load_si128((const __m128i*)(values + i)), zero), ceiling);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(clipped, _mm_load_si128((const __m128i*)(weights + i))));
+    }
 
-            chess::Movelist legal_moves;
-            chess::movegen::legalmoves(legal_moves, nboard);
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
 
-            if (std::find(legal_moves.begin(), legal_moves.end(), pv_move) == legal_moves.end()) {
-                return;
-            }
+    return _mm_cvtsi128_si32(sum);
+#else
+    int32_t sum = 0;
 
-            pv_line.add(pv_move);
-            nboard.makeMove(pv_move);
-            hashes.insert(zh);
-            zh = nboard.zobrist();
-        }
-        else {
-            return;
-        }
+    for (uint16_t i = 0; i < NNUE_HIDDEN_SIZE; i++) {
+        sum += std::clamp<int32_t>(values[i], 0, NNUE_QA) * weights[i];
     }
+
+    return sum;
+#endif
 }
 
-int64_t now_ms() {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::system_clock::now().time_since_epoch()
-    ).count();
+// Score from the side to move's point of view
+int32_t nnue_evaluate(const nnue_network& network, const nnue_accumulator& accumulator, chess::Color side) {
+    int32_t sum = nnue_output_sum(accumulator.values[side], network.output_weights[0]);
+    sum += nnue_output_sum(accumulator.values[~side], network.output_weights[1]);
+
+    int32_t score = (sum + network.output_bias) * NNUE_SCALE / (NNUE_QA * NNUE_QB);
+
+    return std::clamp(score, -NNUE_MAX_SCORE, NNUE_MAX_SCORE);
 }
 
-int32_t quiescence(chess::Board& board, std::vector<chess::Move>& move_stack, int8_t depth, int8_t level, int32_t alpha, int32_t beta) {
-    nodes += 1;
+// Pawn structure terms depend only on pawn placement, so they are cached per
+// worker under a zobrist key of the pawns alone.
+struct pawn_table_entry {
+    uint64_t key = ~0ULL; // no pawn key matches an empty entry
+    int32_t score[N_PHASES];
+    chess::Bitboard passed_pawns[N_PLAYERS];
+    uint8_t open_files[N_PLAYERS];
+};
 
-    if (level > seldepth) {
-        seldepth = level;
-    }
+struct search_context;
 
-    int32_t score = score_board(board);
+// Everything a single search thread mutates. Threads only share the position table.
+struct search_worker {
+    uint16_t id = 0;
+    search_context& context;
+    chess::Board board = chess::Board(chess::constants::STARTPOS);
+    std::vector<chess::Move> move_stack;
+    eval_accumulator accumulators[MAX_PLY];
+    const nnue_network* network = nullptr; // set per search, null for the hand crafted eval
+    nnue_accumulator nnue_accumulators[MAX_PLY];
+    std::atomic<uint64_t> nodes = 0; // only written by its own thread, read by the others
+    uint16_t seldepth = 0;
+    uint16_t stop_check_countdown = 0;
+    chess::Move killer_moves[MAX_PLY][MAX_KILLER_MOVES];
+    // Triangular PV table, row level holds the best line from that ply on
+    chess::Move pv_table[MAX_PLY][MAX_PLY];
+    uint8_t pv_length[MAX_PLY];
+    chess::Move countermove_table[N_SQUARES][N_SQUARES] = {0};
+    uint16_t history_table[N_PLAYERS][N_SQUARES][N_SQUARES] = {0};
+    std::vector<pawn_table_entry> pawn_table = std::vector<pawn_table_entry>(PAWN_TABLE_SIZE);
+    uint64_t pawn_table_probes = 0;
+    uint64_t pawn_table_hits = 0;
+    chess::Move root_best_move = chess::Move::NO_MOVE;
+    chess::Move best_move = chess::Move::NO_MOVE;
+    std::vector<search_info> root_lines; // MultiPV lines of the last completed depth, best first
+    std::vector<chess::Move> excluded_root_moves; // root moves of the lines already searched this depth
+    int32_t best_score = 0;
+    int8_t completed_depth = 0;
 
-    if (score >= beta) {
-        return beta;
-    }
+    search_worker(search_context& context, uint16_t id) : id(id), context(context) {}
+};
 
-    if (score < (alpha - DELTA_PRUNING_CUTOFF)) {
-        return alpha;
-    }
+struct position_table_entry {
+    int32_t value;
+    chess::Move best_move;
+    pt_flag flag;
+    int8_t leaf_distance;
+};
 
-    if (score > alpha) {
-        alpha = score;
-    }
+// A slot packs a whole entry into two words: value (32) | move (16) | leaf distance (8) |
+// flag (2) | age (6) as data, and the zobrist key xored with that data. Threads read and
+// write slots without locking; a torn slot fails the key check instead of returning garbage.
+// A zeroed slot is empty, so the flag is stored off by one.
+struct position_table_slot {
+    uint64_t key;
+    uint64_t data;
+};
 
-    chess::Movelist legal_moves;
-    chess::movegen::legalmoves(legal_moves, board);
+struct alignas(64) position_table_bucket {
+    position_table_slot slots[PTABLE_BUCKET_SLOTS];
+};
 
-    chess::Movelist quiescence_moves;
+static_assert(sizeof(position_table_bucket) == 64, "position table buckets must fill exactly one cache line");
 
-    for (chess::Move move : legal_moves) {
-        if (!is_quiet_move(board, move, -depth)) {
-            quiescence_moves.add(move);
-        }
+// Backing memory for the position table, 2MB aligned and advised as transparent
+// huge pages on linux so probes don't thrash the TLB. Falls back to normal pages.
+void* allocate_table_memory(size_t bytes) {
+#if defined(__linux__)
+    size_t huge_bytes = (bytes + PTABLE_HUGE_PAGE_SIZE - 1) / PTABLE_HUGE_PAGE_SIZE * PTABLE_HUGE_PAGE_SIZE;
+    void* memory = std::aligned_alloc(PTABLE_HUGE_PAGE_SIZE, huge_bytes);
+
+    if (memory != nullptr) {
+        madvise(memory, huge_bytes, MADV_HUGEPAGE);
+        return memory;
     }
+#endif
+
+#if defined(_WIN32)
+    return _aligned_malloc(bytes, 64);
+#else
+    return std::aligned_alloc(64, bytes);
+#endif
+}
 
-    sort_moves(quiescence_moves, board, move_stack, level);
+void free_table_memory(void* memory) {
+#if defined(_WIN32)
+    _aligned_free(memory);
+#else
+    std::free(memory);
+#endif
+}
 
-    for (chess::Move move : quiescence_moves) {
-        board.makeMove(move);
-        move_stack.push_back(move);
+struct transposition_table {
+    position_table_bucket* buckets = nullptr;
+    size_t bucket_count = 0;
+    uint64_t mask = 0;
+    std::atomic<uint8_t> age = 0; // shared by every context searching this table
 
-        score = -quiescence(board, move_stack, depth-1, level+1, -beta, -alpha);
+    transposition_table() = default;
+    transposition_table(const transposition_table&) = delete;
+    transposition_table& operator=(const transposition_table&) = delete;
 
-        board.unmakeMove(move);
-        move_stack.pop_back();
+    ~transposition_table() {
+        free_table_memory(buckets);
+    }
 
-        if (score >= beta) {
-            return beta;
+    // Frees the old buckets, so no context sharing the table may be searching. Keeps the
+    // old buckets and returns false if the new ones can't be allocated.
+    bool resize(size_t megabytes) {
+        megabytes = std::clamp(megabytes, (size_t)PTABLE_MIN_SIZE_MB, (size_t)PTABLE_MAX_SIZE_MB);
+
+        size_t new_bucket_count = 1;
+        while (new_bucket_count * 2 * sizeof(position_table_bucket) <= megabytes * 1024 * 1024) {
+            new_bucket_count *= 2;
         }
 
-        if (score > alpha) {
-            alpha = score;
+        position_table_bucket* new_buckets = (position_table_bucket*)allocate_table_memory(new_bucket_count * sizeof(position_table_bucket));
+
+        if (new_buckets == nullptr) {
+            return false;
         }
+
+        free_table_memory(buckets);
+        buckets = new_buckets;
+        bucket_count = new_bucket_count;
+        mask = bucket_count - 1;
+        clear();
+
+        return true;
     }
 
-    return alpha;
-}
+    // Like resize, must not run while any context sharing the table is searching
+    void clear() {
+        memset(buckets, 0, bucket_count * sizeof(position_table_bucket));
+        age.store(0, std::memory_order_relaxed);
+    }
 
-bool stop_search() {
-    return stop || (movetime && (now_ms()-search_start_time) >= movetime);
-}
+    void new_search() {
+        age.store((age.load(std::memory_order_relaxed) + 1) & ((1 << PTABLE_AGE_BITS) - 1), std::memory_order_relaxed);
+    }
 
-int32_t alpha_beta(chess::Board& board, std::vector<chess::Move>& move_stack, int8_t depth, int8_t level, int32_t alpha, int32_t beta, bool can_null_move=true) {
-    if (stop_search()) {
-        return SCORE_NONE;
+    static uint64_t pack(int32_t value, chess::Move best_move, pt_flag flag, int8_t leaf_distance, uint8_t age) {
+        return (uint64_t)(uint32_t)value
+            | ((uint64_t)best_move.move() << 32)
+            | ((uint64_t)(uint8_t)leaf_distance << 48)
+            | ((uint64_t)(flag + 1) << 56)
+            | ((uint64_t)age << 58);
     }
 
-    nodes += 1;
+    static position_table_entry unpack(uint64_t data) {
+        return {
+            (int32_t)(uint32_t)data,
+            chess::Move((uint16_t)(data >> 32)),
+            (pt_flag)(((data >> 56) & 3) - 1),
+            (int8_t)(uint8_t)(data >> 48)
+        };
+    }
 
-    int32_t alpha_orig = alpha;
-    int32_t score = SCORE_NONE;
+    static uint8_t data_age(uint64_t data) {
+        return data >> 58;
+    }
 
-    bool pv_node = (beta - alpha) > 1;
+    static int8_t data_leaf_distance(uint64_t data) {
+        return (int8_t)(uint8_t)(data >> 48);
+    }
 
-    if (level != 0) {
-        alpha = std::max(alpha, (int32_t)(-CHECKMATE_SCORE + level));
-        beta = std::min(beta, (int32_t)(CHECKMATE_SCORE - level - 1));
+    static uint64_t load_word(const uint64_t& word) {
+        return std::atomic_ref<const uint64_t>(word).load(std::memory_order_relaxed);
+    }
 
-        if (alpha >= beta) {
-            return alpha;
-        }
+    static void store_word(uint64_t& word, uint64_t value) {
+        std::atomic_ref<uint64_t>(word).store(value, std::memory_order_relaxed);
     }
 
-    uint64_t pt_hash = board.zobrist();
-    position_table_entry pt_entry;
-    chess::Move pt_best_move = chess::Move::NO_MOVE;
+    static uint8_t age_distance(uint64_t data, uint8_t current_age) {
+        return (current_age - data_age(data)) & ((1 << PTABLE_AGE_BITS) - 1);
+    }
 
-    bool pt_entry_exists = position_table.count(pt_hash);
-    if (pt_entry_exists) {
-        pt_entry = position_table[pt_hash];
-        if (pt_entry.leaf_distance >= depth && !pv_node) {
-            if (pt_entry.flag == pt_flag::LOWER && pt_entry.value >= beta) {
-                return beta;
-            }
-            else if (pt_entry.flag == pt_flag::UPPER && pt_entry.value <= alpha) {
-                return alpha;
-            }
-            else if (pt_entry.flag == pt_flag::EXACT) {
-                return pt_entry.value;
+    bool probe(uint64_t hash, position_table_entry& entry) const {
+        const position_table_bucket& bucket = buckets[hash & mask];
+
+        for (const position_table_slot& slot : bucket.slots) {
+            uint64_t data = load_word(slot.data);
+
+            if (data && (load_word(slot.key) ^ data) == hash) {
+                entry = unpack(data);
+                return true;
             }
         }
 
-        pt_best_move = pt_entry.best_move;
-        score = pt_entry.value;
+        return false;
     }
 
-    if (depth <= 0) {
-        return quiescence(board, move_stack, depth, level, alpha, beta);
-    }
+    void store(uint64_t hash, int32_t value, chess::Move best_move, pt_flag flag, int8_t leaf_distance) {
+        position_table_bucket& bucket = buckets[hash & mask];
+        position_table_slot* replace = nullptr;
+        int32_t replace_worth = INT32_MAX;
+        uint8_t current_age = age.load(std::memory_order_relaxed);
 
-    bool futility_prunable = false;
+        for (position_table_slot& slot : bucket.slots) {
+            uint64_t data = load_word(slot.data);
 
-    chess::GameResult outcome = board.isGameOver().second;
-    chess::GameResultReason outcome_reason = board.isGameOver().first;
+            if (data && (load_word(slot.key) ^ data) == hash) {
+                // Keep a deeper result from this search unless the new one is exact
+                if (flag != pt_flag::EXACT && age_distance(data, current_age) == 0 && leaf_distance + 2 < data_leaf_distance(data)) {
+                    return;
+                }
 
-    bool is_check = board.inCheck();
+                if (best_move == chess::Move::NO_MOVE) {
+                    best_move = unpack(data).best_move;
+                }
 
-    if (!pv_node && outcome == chess::GameResult::NONE && !is_check) {
-        if (can_null_move && level != 0 && depth >= 3) {
-            if (score == SCORE_NONE) {
-                score = score_board(board);
+                replace = &slot;
+                break;
             }
 
-            int16_t nmp_reduction = (int16_t)(3.0 + (float)depth / 3.0 + std::min((float)(score - beta)/200.0, 3.0));
-            
-            
-            if (nmp_reduction > 0) {
-                board.makeNullMove();
-                move_stack.push_back(chess::Move::NULL_MOVE);
+            // Empty slots first, then the shallowest and stalest entry
+            int32_t worth = data ? data_leaf_distance(data) - PTABLE_AGE_WEIGHT * age_distance(data, current_age) : INT32_MIN;
 
-                score = alpha_beta(board, move_stack, depth - nmp_reduction, level+1, -beta, -beta+1, false);
+            if (worth < replace_worth) {
+                replace_worth = worth;
+                replace = &slot;
+            }
+        }
 
-                board.unmakeNullMove();
-                move_stack.pop_back();
+        uint64_t data = pack(value, best_move, flag, leaf_distance, current_age);
 
-                if (score == SCORE_NONE) {
-                    return SCORE_NONE;
-                }
+        store_word(replace->key, hash ^ data);
+        store_word(replace->data, data);
+    }
 
-                score = -score;
+    // Permille of sampled slots filled during the current search
+    uint16_t hashfull() const {
+        uint16_t filled = 0;
+        size_t sampled_buckets = std::min(bucket_count, (size_t)(PTABLE_HASHFULL_SAMPLES / PTABLE_BUCKET_SLOTS));
+        uint8_t current_age = age.load(std::memory_order_relaxed);
 
-                if (score >= beta && !IS_MATE_SCORE(score)) {
-                    return beta;
-                }
+        for (size_t i = 0; i < sampled_buckets; i++) {
+            for (const position_table_slot& slot : buckets[i].slots) {
+                uint64_t data = load_word(slot.data);
+                filled += data && data_age(data) == current_age;
             }
         }
 
-        if (depth <= FUTILITY_DEPTH) {
-            if (score == SCORE_NONE) {
-                score = score_board(board);
-            }
+        return filled * 1000 / (sampled_buckets * PTABLE_BUCKET_SLOTS);
+    }
+};
 
-            if ((score + FUTILITY_MARGINS[depth]) < alpha) {
-                futility_prunable = true;
-            }
+std::shared_ptr<transposition_table> make_shared_table(size_t megabytes) {
+    std::shared_ptr<transposition_table> table = std::make_shared<transposition_table>();
+    return table->resize(megabytes) ? table : nullptr;
+}
+
+// One independent search: its root position, limits, stop flag and workers. Contexts
+// either share a position table or get a private one, so any number of them can search
+// concurrently in one process.
+struct search_context {
+    std::shared_ptr<transposition_table> table;
+    std::vector<std::unique_ptr<search_worker>> workers;
+    chess::Board board = chess::Board(chess::constants::STARTPOS);
+    search_limits limits;
+    std::atomic<bool> stop = true;
+    cancellation_token cancel;
+    search_info_callback on_info;
+    int64_t start_time = 0;
+    std::atomic<int64_t> clock_start = 0; // when the time budgets started, moved to ponderhit
+    std::atomic<bool> pondering = false; // time limits wait for ponderhit
+    int64_t optimum_time = 0; // soft budget checked between iterations, zero if none
+    int64_t maximum_time = 0; // hard budget checked during the search, zero if none
+    int32_t move_overhead = DEFAULT_MOVE_OVERHEAD;
+    int32_t multipv = DEFAULT_MULTIPV;
+    std::shared_ptr<const nnue_network> network = embedded_network();
+    bool use_nnue = true; // only takes effect once a network is loaded
+
+    search_context(std::shared_ptr<transposition_table> shared_table = nullptr, int32_t thread_count = DEFAULT_THREADS) : table(shared_table) {
+        initialize_tables();
+
+        if (!table) {
+            table = make_shared_table(PTABLE_SIZE_MB);
         }
 
-        if (depth <= REVERSE_FUTILITY_DEPTH) {
-            if (score == SCORE_NONE) {
-                score = score_board(board);
-            }
-            
-            if ((score - REVERSE_FUTILITY_MARGINS[depth]) > beta) {
-                return score;
-            }
+        // A table that couldn't be allocated falls back to the smallest one
+        if (!table) {
+            table = make_shared_table(PTABLE_MIN_SIZE_MB);
         }
-    }
 
-    if (outcome != chess::GameResult::NONE || board.isRepetition(2) || board.isHalfMoveDraw()) {
-        score = outcome_reason == chess::GameResultReason::CHECKMATE ? -CHECKMATE_SCORE + level : 0;
-        if (pt_entry_exists || position_table.size() < MAX_PTABLE_SIZE) {
-            position_table[pt_hash] = {score, chess::Move::NO_MOVE, pt_flag::EXACT, depth};
+        if (!table) {
+            throw std::bad_alloc();
         }
 
-        return score;
+        set_thread_count(thread_count);
     }
 
-    uint8_t move_count = 0;
-    chess::Move best_move = chess::Move::NO_MOVE;
-    int32_t best_score = -CHECKMATE_SCORE-1;
+    search_context(const search_context&) = delete;
+    search_context& operator=(const search_context&) = delete;
+
+    void set_thread_count(int32_t thread_count) {
+        thread_count = std::clamp(thread_count, 1, MAX_THREADS);
+
+        workers.resize(thread_count);
+
+        for (int32_t i = 0; i < thread_count; i++) {
+            if (!workers[i]) {
+                workers[i] = std::make_unique<search_worker>(*this, i);
+            }
+        }
+    }
+
+    uint64_t total_nodes() const {
+        uint64_t nodes = 0;
+
+        for (const std::unique_ptr<search_worker>& worker : workers) {
+            nodes += worker->nodes.load(std::memory_order_relaxed);
+        }
+
+        return nodes;
+    }
+};
+
+void shrink_history(uint16_t table[N_PLAYERS][N_SQUARES][N_SQUARES]) {
+    for (int i = 0; i < N_PLAYERS; i++) {
+        for (int j = 0; j < N_SQUARES; j++) {
+            for (int k = 0; k < N_SQUARES; k++) {
+                table[i][j][k] /= HISTORY_SHRINK_FACTOR;
+            }
+        }
+    }
+}
+
+constexpr inline int32_t lerp(int32_t start, int32_t end, float position) {
+    return (int32_t)((1-position) * (float)start + position * (float)end);
+}
+
+float material_phase(int16_t remaining) {
+    return std::max(0.0f, std::min(1.0f, ((float)PHASE_TOTAL-(float)remaining)/(float)PHASE_TOTAL));
+}
+
+float game_phase(const chess::Board& board) {
+    int16_t remaining = 0;
+    remaining += board.pieces(chess::PieceType::PAWN).count() * PHASE_PIECE_WEIGHTS[0];
+    remaining += board.pieces(chess::PieceType::KNIGHT).count() * PHASE_PIECE_WEIGHTS[1];
+    remaining += board.pieces(chess::PieceType::BISHOP).count() * PHASE_PIECE_WEIGHTS[2];
+    remaining += board.pieces(chess::PieceType::ROOK).count() * PHASE_PIECE_WEIGHTS[3];
+    remaining += board.pieces(chess::PieceType::QUEEN).count() * PHASE_PIECE_WEIGHTS[4];
+
+    return material_phase(remaining);
+}
+
+void make_move(search_worker& worker, chess::Move move) {
+    size_t ply = worker.move_stack.size();
+    piece_changes changes = move_piece_changes(worker.board, move);
+
+    update_accumulator(worker.accumulators[ply], worker.accumulators[ply+1], changes);
+
+    if (worker.network) {
+        update_nnue_accumulator(*worker.network, worker.nnue_accumulators[ply], worker.nnue_accumulators[ply+1], changes);
+    }
+
+    worker.board.makeMove(move);
+    worker.move_stack.push_back(move);
+}
+
+void unmake_move(search_worker& worker, chess::Move move) {
+    worker.board.unmakeMove(move);
+    worker.move_stack.pop_back();
+}
+
+void make_null_move(search_worker& worker) {
+    size_t ply = worker.move_stack.size();
+    worker.accumulators[ply+1] = worker.accumulators[ply];
+
+    if (worker.network) {
+        worker.nnue_accumulators[ply+1] = worker.nnue_accumulators[ply];
+    }
+
+    worker.board.makeNullMove();
+    worker.move_stack.push_back(chess::Move::NULL_MOVE);
+}
+
+void unmake_null_move(search_worker& worker) {
+    worker.board.unmakeNullMove();
+    worker.move_stack.pop_back();
+}
+
+bool is_quiet_move(const chess::Board& board, chess::Move move, int8_t quiescence_depth = 0) {
+    if (board.isCapture(move)) {
+        return false;
+    }
+
+    if ((quiescence_depth <= QUIESCENCE_CHECK_DEPTH_LIMIT) && ((board.givesCheck(move) != chess::CheckType::NO_CHECK) || board.inCheck())) {
+        return false;
+    }
+
+    if (move.typeOf() == chess::Move::PROMOTION) {
+        return false;
+    }
+
+    return true;
+}
+
+// Static exchange evaluation, true when the capture sequence started by move on its target
+// square wins at least threshold centipawns with both sides always recapturing with their
+// least valuable attacker. Pins are ignored.
+bool see_ge(const chess::Board& board, chess::Move move, int32_t threshold = 0) {
+    // Promotions, en passant and castling are rare enough to not be worth the exchange
+    if (move.typeOf() != chess::Move::NORMAL) {
+        return threshold <= 0;
+    }
+
+    chess::Square from = move.from();
+    chess::Square to = move.to();
+
+    int32_t swap = CP_PIECE_VALUES[board.at<chess::PieceType>(to)] - threshold;
+
+    if (swap < 0) {
+        return false;
+    }
+
+    swap = CP_PIECE_VALUES[board.at<chess::PieceType>(from)] - swap;
+
+    if (swap <= 0) {
+        return true;
+    }
+
+    chess::Bitboard occupied = board.occ() ^ chess::Bitboard::fromSquare(from) ^ chess::Bitboard::fromSquare(to);
+    chess::Bitboard diagonal_sliders = board.pieces(chess::PieceType::BISHOP) | board.pieces(chess::PieceType::QUEEN);
+    chess::Bitboard orthogonal_sliders = board.pieces(chess::PieceType::ROOK) | board.pieces(chess::PieceType::QUEEN);
+
+    chess::Bitboard attackers = chess::attacks::attackers(board, chess::Color::WHITE, to) | chess::attacks::attackers(board, chess::Color::BLACK, to);
+
+    // Sliders lined up behind the moving piece
+    attackers |= chess::attacks::bishop(to, occupied) & diagonal_sliders;
+    attackers |= chess::attacks::rook(to, occupied) & orthogonal_sliders;
+
+    chess::Color side = board.at(from).color();
+    bool result = true;
+
+    while (true) {
+        side = ~side;
+        attackers &= occupied;
+
+        chess::Bitboard side_attackers = attackers & board.us(side);
+
+        if (!side_attackers) {
+            break;
+        }
+
+        result = !result;
+
+        // Least valuable attacker recaptures, opening up any x-rays behind it
+        chess::Bitboard attacker;
+        chess::PieceType type;
+
+        for (int8_t index = 0; index < 6; index++) {
+            type = chess::PieceType(chess::PieceType::underlying(index));
+            attacker = side_attackers & board.pieces(type);
+
+            if (attacker) {
+                break;
+            }
+        }
+
+        // The king can only take last, if the other side still has an attacker the capture is illegal
+        if (type == chess::PieceType::KING) {
+            return (attackers & board.us(~side)) ? !result : result;
+        }
+
+        swap = CP_PIECE_VALUES[type] - swap;
+
+        if (swap < (int32_t)result) {
+            break;
+        }
+
+        occupied ^= chess::Bitboard::fromSquare(attacker.lsb());
+
+        if (type == chess::PieceType::PAWN || type == chess::PieceType::BISHOP || type == chess::PieceType::QUEEN) {
+            attackers |= chess::attacks::bishop(to, occupied) & diagonal_sliders;
+        }
+
+        if (type == chess::PieceType::ROOK || type == chess::PieceType::QUEEN) {
+            attackers |= chess::attacks::rook(to, occupied) & orthogonal_sliders;
+        }
+    }
+
+    return result;
+}
+
+chess::Move countermove(const search_worker& worker) {
+    if (worker.move_stack.empty() || worker.move_stack.back() == chess::Move::NULL_MOVE) {
+        return chess::Move::NO_MOVE;
+    }
+
+    chess::Move previous = worker.move_stack.back();
+    return worker.countermove_table[previous.from().index()][previous.to().index()];
+}
+
+int32_t score_move(const search_worker& worker, const chess::Board& board, chess::Move move, int8_t level, chess::Move pt_best_move = chess::Move::NO_MOVE) {
+    const std::vector<chess::Move>& move_stack = worker.move_stack;
+
+    if (move == pt_best_move) {
+        return 30000;
+    }
+
+    // Pawn promotion
+    if (move.typeOf() == chess::Move::PROMOTION) {
+        return 29000;
+    }
+
+    // Pawn about to promote
+    chess::Piece attacker = board.at(move.from());
+    if (attacker.type() == chess::PieceType::PAWN && (move.to().rank() == chess::Rank::RANK_2 || move.to().rank() == chess::Rank::RANK_7)) {
+        return 28000;
+    }
+
+    // MVV - LVA for captures that don't lose material, losing ones go after the quiets
+    chess::Piece victim = board.at(move.to());
+    if (victim != chess::Piece::NONE) {
+        int32_t mvv_lva = CP_PIECE_VALUES[victim.type()] - CP_PIECE_VALUES[attacker.type()];
+
+        return see_ge(board, move) ? 27000 + mvv_lva : mvv_lva - 1000;
+    }
+
+    // Killer move heuristic
+    uint8_t km_idx = 0;
+    for (chess::Move km : worker.killer_moves[level]) {
+        if (move == km) {
+            return 26000 - km_idx;
+        }
+        km_idx++;
+    }
+
+    // Countermove heuristic
+    if (move == countermove(worker)) {
+        return 25000;
+    }
+
+    // Take last moved piece
+    if (move_stack.size() > 0 && move_stack[move_stack.size()-1] != chess::Move::NULL_MOVE && move_stack[move_stack.size()-1].to().index() == move.to().index()) {
+        return 24000;
+    }
+
+    // Checks
+    if (board.givesCheck(move) != chess::CheckType::NO_CHECK) {
+        return 23000;
+    }
+
+    // History heuristic
+    int32_t score = worker.history_table[board.sideToMove()][move.from().index()][move.to().index()];
+
+    return score;
+}
+
+void sort_moves(search_worker& worker, chess::Movelist& moves, int8_t level, const chess::Move pt_best_move = chess::Move::NO_MOVE) {
+    for (chess::Move& move : moves) {
+        move.setScore(score_move(worker, worker.board, move, level, pt_best_move));
+    }
+
+    std::sort(moves.begin(), moves.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.score() > rhs.score();
+    });
+}
+
+// Squares one piece attacks, or for pawns can capture on or push to
+chess::Bitboard piece_reach(const chess::Board& board, chess::PieceType type, chess::Color color, chess::Square square) {
+    chess::Bitboard occupied = board.occ();
+    chess::Bitboard reach;
+
+    switch (type.internal()) {
+        case chess::PieceType::underlying::PAWN: {
+            int8_t offset = color == chess::Color::WHITE ? 8 : -8;
+            chess::Square push = square.index() + offset;
+
+            reach = chess::attacks::pawn(color, square) & board.them(color);
+
+            if (!occupied.check(push.index())) {
+                reach |= chess::Bitboard::fromSquare(push);
+
+                if (square.rank() == chess::Rank::rank(chess::Rank::RANK_2, color) && !occupied.check(push.index() + offset)) {
+                    reach |= chess::Bitboard::fromSquare(push.index() + offset);
+                }
+            }
+            break;
+        }
+        case chess::PieceType::underlying::KNIGHT:
+            reach = chess::attacks::knight(square);
+            break;
+        case chess::PieceType::underlying::BISHOP:
+            reach = chess::attacks::bishop(square, occupied);
+            break;
+        case chess::PieceType::underlying::ROOK:
+            reach = chess::attacks::rook(square, occupied);
+            break;
+        case chess::PieceType::underlying::QUEEN:
+            reach = chess::attacks::queen(square, occupied);
+            break;
+        default:
+            reach = chess::attacks::king(square);
+            break;
+    }
+
+    return reach;
+}
+
+// Cheap legality test for a quiet NORMAL move remembered from another node (killers,
+// countermoves), without generating the move list.
+bool is_legal_quiet(chess::Board& board, chess::Move move) {
+    if (move == chess::Move::NO_MOVE || move == chess::Move::NULL_MOVE || move.typeOf() != chess::Move::NORMAL) {
+        return false;
+    }
+
+    chess::Color side = board.sideToMove();
+    chess::Piece piece = board.at(move.from());
+
+    if (piece == chess::Piece::NONE || piece.color() != side || board.at(move.to()) != chess::Piece::NONE) {
+        return false;
+    }
+
+    if (piece.type() == chess::PieceType::PAWN && chess::Square::back_rank(move.to(), ~side)) {
+        return false;
+    }
+
+    chess::Bitboard reach = piece_reach(board, piece.type(), side, move.from());
+
+    if (!reach.check(move.to().index())) {
+        return false;
+    }
+
+    board.makeMove(move);
+    bool legal = !board.isAttacked(board.kingSq(side), ~side);
+    board.unmakeMove(move);
+
+    return legal;
+}
+
+bool is_legal_move(chess::Board& board, chess::Move move) {
+    if (move == chess::Move::NO_MOVE || move == chess::Move::NULL_MOVE) {
+        return false;
+    }
+
+    chess::Piece piece = board.at(move.from());
+
+    if (piece == chess::Piece::NONE || piece.color() != board.sideToMove()) {
+        return false;
+    }
+
+    if (move.typeOf() == chess::Move::NORMAL && board.at(move.to()) == chess::Piece::NONE) {
+        return is_legal_quiet(board, move);
+    }
+
+    // Rarer move kinds are checked against the legal moves of the moving piece type only
     chess::Movelist moves;
-    chess::movegen::legalmoves(moves, board);
-    sort_moves(moves, board, move_stack, level, pt_best_move);
+    chess::movegen::legalmoves(moves, board, 1 << (int)piece.type());
 
-    for (chess::Move move : moves) {
-        move_count++;
+    return std::find(moves.begin(), moves.end(), move) != moves.end();
+}
+
+enum pick_stage {
+    PICK_TT_MOVE = 0,
+    PICK_GENERATE_CAPTURES,
+    PICK_CAPTURES,
+    PICK_KILLERS,
+    PICK_COUNTERMOVE,
+    PICK_GENERATE_QUIETS,
+    PICK_QUIETS,
+    PICK_BAD_CAPTURES,
+    PICK_DONE
+};
+
+// MVV-LVA, with promotions ahead of every plain capture
+int16_t capture_score(const chess::Board& board, chess::Move move) {
+    chess::PieceType attacker = board.at<chess::PieceType>(move.from());
+    chess::PieceType victim = move.typeOf() == chess::Move::ENPASSANT ? chess::PieceType(chess::PieceType::PAWN) : board.at<chess::PieceType>(move.to());
+
+    int16_t score = CP_PIECE_VALUES[victim] - CP_PIECE_VALUES[attacker];
+
+    if (move.typeOf() == chess::Move::PROMOTION) {
+        score += 2000 + CP_PIECE_VALUES[move.promotionType()];
+    }
+
+    return score;
+}
+
+// Hands out a node's moves one at a time, generating and scoring each group only when
+// the previous one is exhausted, so nodes that cut off early skip most of the work.
+struct move_picker {
+    search_worker& worker;
+    int8_t level;
+    chess::Move tt_move;
+    chess::Move counter_move = chess::Move::NO_MOVE;
+    pick_stage stage = PICK_TT_MOVE;
+    chess::Movelist moves;
+    chess::Movelist bad_captures;
+    uint8_t index = 0;
+    uint8_t killer_index = 0;
+    chess::Move tried[MAX_KILLER_MOVES + 2];
+    uint8_t tried_count = 0;
+
+    move_picker(search_worker& worker, int8_t level, chess::Move tt_move) : worker(worker), level(level), tt_move(tt_move) {}
+
+    bool already_tried(chess::Move move) const {
+        return std::find(tried, tried + tried_count, move) != tried + tried_count;
+    }
+
+    // Partial selection sort, only the moves actually handed out get ordered
+    chess::Move pick_best() {
+        uint8_t best = index;
+
+        for (uint8_t i = index + 1; i < moves.size(); i++) {
+            if (moves[i].score() > moves[best].score()) {
+                best = i;
+            }
+        }
+
+        std::swap(moves[index], moves[best]);
+        return moves[index++];
+    }
+
+    void score_captures() {
+        const chess::Board& board = worker.board;
+
+        for (chess::Move& move : moves) {
+            int16_t score = capture_score(board, move);
+
+            // Captures losing the exchange sort below every winning or even one
+            if (!see_ge(board, move)) {
+                score -= 10000;
+            }
+
+            move.setScore(score);
+        }
+    }
+
+    void score_quiets() {
+        const chess::Board& board = worker.board;
+        chess::Color side = board.sideToMove();
+        chess::Square enemy_king = board.kingSq(~side);
+        chess::Bitboard occupied = board.occ();
+
+        // Squares each piece type would give a direct check from
+        chess::Bitboard check_squares[6] = {
+            chess::attacks::pawn(~side, enemy_king),
+            chess::attacks::knight(enemy_king),
+            chess::attacks::bishop(enemy_king, occupied),
+            chess::attacks::rook(enemy_king, occupied),
+            chess::attacks::queen(enemy_king, occupied),
+            0
+        };
+
+        for (chess::Move& move : moves) {
+            chess::PieceType type = board.at<chess::PieceType>(move.from());
+            int16_t score = worker.history_table[side][move.from().index()][move.to().index()];
+
+            if (move.typeOf() == chess::Move::PROMOTION) {
+                score = 30000 + CP_PIECE_VALUES[move.promotionType()];
+            }
+            else if (type == chess::PieceType::PAWN && (move.to().rank() == chess::Rank::RANK_2 || move.to().rank() == chess::Rank::RANK_7)) {
+                score = 25000;
+            }
+            else if (check_squares[type].check(move.to().index())) {
+                score = 20000;
+            }
+
+            move.setScore(score);
+        }
+    }
+
+    chess::Move next() {
+        chess::Board& board = worker.board;
+
+        switch (stage) {
+            case PICK_TT_MOVE:
+                stage = PICK_GENERATE_CAPTURES;
+
+                if (is_legal_move(board, tt_move)) {
+                    tried[tried_count++] = tt_move;
+                    return tt_move;
+                }
+                [[fallthrough]];
+
+            case PICK_GENERATE_CAPTURES:
+                chess::movegen::legalmoves<chess::movegen::MoveGenType::CAPTURE>(moves, board);
+                score_captures();
+                index = 0;
+                stage = PICK_CAPTURES;
+                [[fallthrough]];
+
+            case PICK_CAPTURES:
+                while (index < moves.size()) {
+                    chess::Move move = pick_best();
+
+                    if (move == tt_move) {
+                        continue;
+                    }
+
+                    if (move.score() < -5000) {
+                        bad_captures.add(move);
+                        continue;
+                    }
+
+                    return move;
+                }
+
+                stage = PICK_KILLERS;
+                [[fallthrough]];
+
+            case PICK_KILLERS:
+                while (killer_index < MAX_KILLER_MOVES) {
+                    chess::Move killer = worker.killer_moves[level][killer_index++];
+
+                    if (killer != chess::Move::NO_MOVE && !already_tried(killer) && is_legal_quiet(board, killer)) {
+                        tried[tried_count++] = killer;
+                        return killer;
+                    }
+                }
+
+                stage = PICK_COUNTERMOVE;
+                [[fallthrough]];
+
+            case PICK_COUNTERMOVE:
+                stage = PICK_GENERATE_QUIETS;
+                counter_move = countermove(worker);
+
+                if (counter_move != chess::Move::NO_MOVE && !already_tried(counter_move) && is_legal_quiet(board, counter_move)) {
+                    tried[tried_count++] = counter_move;
+                    return counter_move;
+                }
+                [[fallthrough]];
+
+            case PICK_GENERATE_QUIETS:
+                chess::movegen::legalmoves<chess::movegen::MoveGenType::QUIET>(moves, board);
+                score_quiets();
+                index = 0;
+                stage = PICK_QUIETS;
+                [[fallthrough]];
+
+            case PICK_QUIETS:
+                while (index < moves.size()) {
+                    chess::Move move = pick_best();
+
+                    if (!already_tried(move)) {
+                        return move;
+                    }
+                }
+
+                index = 0;
+                stage = PICK_BAD_CAPTURES;
+                [[fallthrough]];
+
+            case PICK_BAD_CAPTURES:
+                if (index < bad_captures.size()) {
+                    return bad_captures[index++];
+                }
+
+                stage = PICK_DONE;
+                [[fallthrough]];
+
+            case PICK_DONE:
+                break;
+        }
+
+        return chess::Move::NO_MOVE;
+    }
+};
+
+// Pseudo-legal moves of one piece onto squares not held by its own side or covered by enemy pawns
+uint8_t piece_mobility(const chess::Board& board, chess::PieceType type, chess::Color color, chess::Square square, chess::Bitboard safe) {
+    return std::min((piece_reach(board, type, color, square) & safe).count(), 27);
+}
+
+void mobility_score(const chess::Board& board, int32_t mobility[N_PHASES]) {
+    for (uint8_t color = 0; color < N_PLAYERS; color++) {
+        chess::Color side = chess::Color(color);
+
+        chess::Bitboard enemy_pawns = board.pieces(chess::PieceType::PAWN, ~side);
+        chess::Bitboard enemy_pawn_attacks;
+
+        while (enemy_pawns) {
+            enemy_pawn_attacks |= chess::attacks::pawn(~side, enemy_pawns.pop());
+        }
+
+        chess::Bitboard safe = ~board.us(side) & ~enemy_pawn_attacks;
+        chess::Bitboard pieces = board.us(side);
+
+        while (pieces) {
+            chess::Square square = pieces.pop();
+            chess::PieceType type = board.at<chess::PieceType>(square);
+            uint8_t move_count = piece_mobility(board, type, side, square, safe);
+
+            mobility[MIDGAME] += PIECE_MOBILITY_TABLES[type][MIDGAME][move_count] * COLOR_MOD[color];
+            mobility[ENDGAME] += PIECE_MOBILITY_TABLES[type][ENDGAME][move_count] * COLOR_MOD[color];
+        }
+    }
+}
+
+void evaluate_pawn_structure(const chess::Board& board, pawn_table_entry& entry) {
+    uint8_t pawn_file_counts[2][8] = {{0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0}};
+
+    entry.score[MIDGAME] = 0;
+    entry.score[ENDGAME] = 0;
+
+    for (uint8_t color = 0; color < N_PLAYERS; color++) {
+        chess::Bitboard pawns = board.pieces(chess::PieceType::PAWN, chess::Color(color));
+        chess::Bitboard enemy_pawns = board.pieces(chess::PieceType::PAWN, ~chess::Color(color));
+
+        entry.passed_pawns[color].clear();
+
+        while (pawns) {
+            chess::Square square = pawns.pop();
+
+            pawn_file_counts[color][square.file()]++;
+
+            if ((uint8_t)square.file() < 7 && (PASSING_FIELDS[color][square.index()] & enemy_pawns).empty()) {
+                entry.passed_pawns[color].set(square.index());
+            }
+        }
+
+        for (uint8_t phase = 0; phase < N_PHASES; phase++) {
+            entry.score[phase] += PASSED_PAWN_BONUS[phase] * entry.passed_pawns[color].count() * COLOR_MOD[color];
+        }
+    }
+
+    for (uint8_t color = 0; color < N_PLAYERS; color++) {
+        entry.open_files[color] = 0;
+
+        for (uint8_t file = 0; file < 8; file++) {
+            uint8_t count = pawn_file_counts[color][file];
+
+            if (count == 0) {
+                entry.open_files[color] |= 1 << file;
+                continue;
+            }
+
+            bool isolated = (file == 0 || pawn_file_counts[color][file-1] == 0) && (file == 7 || pawn_file_counts[color][file+1] == 0);
+
+            for (uint8_t phase = 0; phase < N_PHASES; phase++) {
+                int32_t penalty = 0;
+                penalty += count == 2 ? DOUBLED_PAWN_PENALTY[phase] : 0;
+                penalty += count >= 3 ? TRIPLED_PAWN_PENALTY[phase] : 0;
+                penalty += isolated ? ISOLATED_PAWN_PENALTY[phase] : 0;
+
+                entry.score[phase] += penalty * COLOR_MOD[color];
+            }
+        }
+    }
+}
+
+const pawn_table_entry& probe_pawn_table(search_worker& worker, uint64_t pawn_key) {
+    pawn_table_entry& entry = worker.pawn_table[pawn_key & (PAWN_TABLE_SIZE - 1)];
+
+    worker.pawn_table_probes++;
+
+    if (entry.key == pawn_key) {
+        worker.pawn_table_hits++;
+    }
+    else {
+        evaluate_pawn_structure(worker.board, entry);
+        entry.key = pawn_key;
+    }
+
+    return entry;
+}
+
+int32_t score_board(search_worker& worker) {
+    chess::Board& board = worker.board;
+
+    if (worker.network) {
+        return nnue_evaluate(*worker.network, worker.nnue_accumulators[worker.move_stack.size()], board.sideToMove());
+    }
+
+    const eval_accumulator& accumulator = worker.accumulators[worker.move_stack.size()];
+
+    float phase = material_phase(accumulator.phase_material);
+
+    int32_t score = lerp(accumulator.position[MIDGAME], accumulator.position[ENDGAME], phase);
+
+    // pieces value matters more in late game
+    score += lerp(accumulator.material[MIDGAME], accumulator.material[ENDGAME], phase) * (1 + (phase/2.0));
+
+    const pawn_table_entry& pawn_entry = probe_pawn_table(worker, accumulator.pawn_key);
+    score += lerp(pawn_entry.score[MIDGAME], pawn_entry.score[ENDGAME], phase);
+
+    int32_t mobility[N_PHASES] = {0, 0};
+    mobility_score(board, mobility);
+    score += lerp(mobility[MIDGAME], mobility[ENDGAME], phase);
+
+    int32_t dbb = lerp(DOUBLE_BISHOP_BONUS[MIDGAME], DOUBLE_BISHOP_BONUS[ENDGAME], phase);
+
+    if (board.pieces(chess::PieceType::BISHOP, chess::Color::WHITE).count() == 2) {
+        score += dbb;
+    };
+
+    if (board.pieces(chess::PieceType::BISHOP, chess::Color::BLACK).count() == 2) {
+        score -= dbb;
+    }
+
+    // Files next to and including each king's file that have none of its own pawns
+    const int32_t ofnkp = lerp(OPEN_FILE_NEAR_KING_PENALTY[MIDGAME], OPEN_FILE_NEAR_KING_PENALTY[ENDGAME], phase);
+
+    for (uint8_t color = 0; color < N_PLAYERS; color++) {
+        uint8_t king_file = board.kingSq(chess::Color(color)).file();
+        uint8_t king_files = (0b111 << king_file >> 1) & 0xFF;
+
+        score += std::popcount((uint8_t)(pawn_entry.open_files[color] & king_files)) * ofnkp * COLOR_MOD[color];
+    }
+
+    score *= COLOR_MOD[board.sideToMove()];
+
+    score += lerp(TEMPO_BONUS[MIDGAME], TEMPO_BONUS[ENDGAME], phase);
+
+    return score;
+}
+
+
+void check_hash(const chess::Board& board) {
+    if (board.hash() != board.zobrist()) {
+        std::cerr << "hash mismatch in " << board.getFen() << ": incremental " << board.hash() << " zobrist " << board.zobrist() << std::endl;
+        std::abort();
+    }
+}
+
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+// Draws that don't need move generation, checkmate and stalemate fall out of the node's own movegen
+bool is_cheap_draw(const chess::Board& board) {
+    return board.isHalfMoveDraw() || board.isInsufficientMaterial() || board.isRepetition(2);
+}
+
+// Quiet moves giving check, only generated for piece types that can reach a checking square
+// or uncover a check from one of their own sliders
+void generate_quiet_checks(const chess::Board& board, chess::Movelist& moves) {
+    chess::Color side = board.sideToMove();
+    chess::Square enemy_king = board.kingSq(~side);
+    chess::Bitboard occupied = board.occ();
+
+    chess::Bitboard check_squares[6] = {
+        chess::attacks::pawn(~side, enemy_king),
+        chess::attacks::knight(enemy_king),
+        chess::attacks::bishop(enemy_king, occupied),
+        chess::attacks::rook(enemy_king, occupied),
+        chess::attacks::queen(enemy_king, occupied),
+        0
+    };
+
+    // Own pieces standing alone between an own slider and the enemy king
+    chess::Bitboard discoverers = 0;
+    chess::Bitboard diagonal_snipers = chess::attacks::bishop(enemy_king, 0) & (board.pieces(chess::PieceType::BISHOP, side) | board.pieces(chess::PieceType::QUEEN, side));
+    chess::Bitboard orthogonal_snipers = chess::attacks::rook(enemy_king, 0) & (board.pieces(chess::PieceType::ROOK, side) | board.pieces(chess::PieceType::QUEEN, side));
+
+    while (diagonal_snipers) {
+        chess::Square sniper = diagonal_snipers.pop();
+        discoverers |= chess::attacks::bishop(enemy_king, occupied) & chess::attacks::bishop(sniper, occupied);
+    }
+
+    while (orthogonal_snipers) {
+        chess::Square sniper = orthogonal_snipers.pop();
+        discoverers |= chess::attacks::rook(enemy_king, occupied) & chess::attacks::rook(sniper, occupied);
+    }
+
+    discoverers &= board.us(side);
+
+    int piece_mask = 0;
+
+    for (int8_t index = 0; index < 6; index++) {
+        chess::PieceType type = chess::PieceType(chess::PieceType::underlying(index));
+        chess::Bitboard pieces = board.pieces(type, side);
+
+        if (pieces & discoverers) {
+            piece_mask |= 1 << index;
+            continue;
+        }
+
+        while (pieces) {
+            chess::Square square = pieces.pop();
+
+            if (piece_reach(board, type, side, square) & ~occupied & check_squares[index]) {
+                piece_mask |= 1 << index;
+                break;
+            }
+        }
+    }
+
+    if (!piece_mask) {
+        return;
+    }
+
+    chess::Movelist quiets;
+    chess::movegen::legalmoves<chess::movegen::MoveGenType::QUIET>(quiets, board, piece_mask);
+
+    for (chess::Move move : quiets) {
+        // Promotions are already generated with the captures, castling checks are too rare to bother
+        if (move.typeOf() != chess::Move::NORMAL) {
+            continue;
+        }
+
+        chess::PieceType type = board.at<chess::PieceType>(move.from());
+
+        if (check_squares[type].check(move.to().index()) || (discoverers.check(move.from().index()) && board.givesCheck(move) != chess::CheckType::NO_CHECK)) {
+            moves.add(move);
+        }
+    }
+}
+
+// Captures that don't lose the exchange and all promotions, plus quiet checks near the
+// horizon. Moves are scored as they are generated: captures and promotions by MVV-LVA like
+// the move picker, quiet checks after all of them.
+void generate_quiescence_moves(const chess::Board& board, chess::Movelist& moves, bool include_checks) {
+    chess::Movelist captures;
+    chess::movegen::legalmoves<chess::movegen::MoveGenType::CAPTURE>(captures, board);
+
+    for (chess::Move move : captures) {
+        // Captures that lose material to the exchange are not worth resolving
+        if (see_ge(board, move)) {
+            move.setScore(capture_score(board, move));
+            moves.add(move);
+        }
+    }
+
+    chess::Color side = board.sideToMove();
+    chess::Bitboard promoting_rank = chess::Bitboard(chess::Rank(chess::Rank::rank(chess::Rank::RANK_7, side)));
+
+    if (board.pieces(chess::PieceType::PAWN, side) & promoting_rank) {
+        chess::Movelist pawn_quiets;
+        chess::movegen::legalmoves<chess::movegen::MoveGenType::QUIET>(pawn_quiets, board, chess::PieceGenType::PAWN);
+
+        for (chess::Move move : pawn_quiets) {
+            if (move.typeOf() == chess::Move::PROMOTION) {
+                move.setScore(2000 + CP_PIECE_VALUES[move.promotionType()]);
+                moves.add(move);
+            }
+        }
+    }
+
+    if (include_checks) {
+        chess::Movelist::size_type first_check = moves.size();
+        generate_quiet_checks(board, moves);
+
+        for (chess::Movelist::size_type i = first_check; i < moves.size(); i++) {
+            moves[i].setScore(-1000);
+        }
+    }
+}
+
+int32_t quiescence(search_worker& worker, int8_t depth, int8_t level, int32_t alpha, int32_t beta) {
+    chess::Board& board = worker.board;
+
+    worker.nodes.store(worker.nodes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    worker.pv_length[level] = level;
+
+    if (level > worker.seldepth) {
+        worker.seldepth = level;
+    }
+
+    if (is_cheap_draw(board)) {
+        return 0;
+    }
+
+    bool is_check = board.inCheck();
+    int32_t score;
+
+    // No standing pat in check, every evasion gets searched so mates at the horizon are seen
+    if (!is_check) {
+        score = score_board(worker);
+
+        if (score >= beta) {
+            return beta;
+        }
+
+        if (score < (alpha - DELTA_PRUNING_CUTOFF)) {
+            return alpha;
+        }
+
+        if (score > alpha) {
+            alpha = score;
+        }
+    }
+
+    chess::Movelist quiescence_moves;
+
+    if (is_check) {
+        // Evasions in the staged picker's order
+        move_picker picker(worker, level, chess::Move::NO_MOVE);
+        chess::Move move;
+
+        while ((move = picker.next()) != chess::Move::NO_MOVE) {
+            quiescence_moves.add(move);
+        }
+
+        if (quiescence_moves.empty()) {
+            return -CHECKMATE_SCORE + level;
+        }
+    }
+    else {
+        generate_quiescence_moves(board, quiescence_moves, -depth <= QUIESCENCE_CHECK_DEPTH_LIMIT);
+
+        std::sort(quiescence_moves.begin(), quiescence_moves.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.score() > rhs.score();
+        });
+    }
+
+    for (chess::Move move : quiescence_moves) {
+        make_move(worker, move);
+
+        score = -quiescence(worker, depth-1, level+1, -beta, -alpha);
+
+        unmake_move(worker, move);
+
+        if (score >= beta) {
+            return beta;
+        }
+
+        if (score > alpha) {
+            alpha = score;
+        }
+    }
+
+    return alpha;
+}
+
+// Splits the clock into an optimum time per move, which iterative deepening stretches or
+// shrinks, and a maximum time the search is stopped at. A movetime is all maximum time,
+// infinite searches have neither, and the move overhead is kept back from both.
+void start_time_manager(search_context& context) {
+    const search_limits& limits = context.limits;
+    bool white = context.board.sideToMove() == chess::Color::WHITE;
+    int32_t time = white ? limits.wtime : limits.btime;
+    int32_t increment = white ? limits.winc : limits.binc;
+
+    context.optimum_time = 0;
+    context.maximum_time = 0;
+
+    if (limits.infinite) {
+        return;
+    }
+
+    if (limits.movetime) {
+        context.maximum_time = std::max(limits.movetime - context.move_overhead, 1);
+        return;
+    }
+
+    if (!time) {
+        return;
+    }
+
+    int64_t available = std::max(time - context.move_overhead, 1);
+    int32_t moves_to_go = limits.movestogo ? std::min(limits.movestogo, TIME_MAX_MOVESTOGO) : TIME_DEFAULT_MOVESTOGO;
+
+    context.maximum_time = std::max(std::min((int64_t)(available * TIME_MAXIMUM_FRACTION), (available / moves_to_go + increment) * TIME_MAXIMUM_SCALE), (int64_t)1);
+    context.optimum_time = std::min(available / moves_to_go + increment * 3 / 4, context.maximum_time);
+}
+
+// Decides after a completed iteration whether the next one is worth starting. The optimum
+// time grows while the best move keeps changing or the score drops, and an iteration that
+// would likely run past the maximum time is not started.
+bool start_next_iteration(const search_context& context, int32_t best_move_stability, int32_t score_drop, int64_t iteration_time, double branching_factor) {
+    if (!context.optimum_time || context.pondering) {
+        return true;
+    }
+
+    int64_t elapsed = now_ms() - context.clock_start;
+    double scale = TIME_STABILITY_SCALES[std::min(best_move_stability, TIME_STABILITY_LEVELS - 1)] * (1.0 + (double)std::clamp(score_drop, 0, TIME_SCORE_DROP_LIMIT) / TIME_SCORE_DROP_LIMIT);
+    int64_t soft_limit = std::min((int64_t)(context.optimum_time * scale), context.maximum_time);
+
+    return elapsed < soft_limit && elapsed + iteration_time * branching_factor < context.maximum_time;
+}
+
+// Full check of the stop flag and limits, reads the clock and every worker's node count
+bool stop_search(const search_context& context) {
+    return context.stop.load(std::memory_order_relaxed)
+        || context.cancel.cancelled()
+        || (context.maximum_time && !context.pondering && (now_ms()-context.clock_start) >= context.maximum_time)
+        || (context.limits.nodes && context.total_nodes() >= context.limits.nodes);
+}
+
+// Called at every alpha_beta node. The stop flag is read every time, the clock and node
+// limits only every STOP_CHECK_INTERVAL calls of a worker.
+bool stop_search(search_worker& worker) {
+    if (worker.context.stop.load(std::memory_order_relaxed)) {
+        return true;
+    }
+
+    if (worker.stop_check_countdown > 0) {
+        worker.stop_check_countdown--;
+        return false;
+    }
+
+    worker.stop_check_countdown = STOP_CHECK_INTERVAL - 1;
+
+    return stop_search(worker.context);
+}
+
+// Mate scores count plies from the root, but table entries outlive the node that stored
+// them. They are kept relative to the node and converted back at the probing ply.
+int32_t score_to_tt(int32_t score, int8_t level) {
+    if (!IS_MATE_SCORE(score)) {
+        return score;
+    }
+
+    return score > 0 ? score + level : score - level;
+}
+
+int32_t score_from_tt(int32_t score, int8_t level) {
+    if (!IS_MATE_SCORE(score)) {
+        return score;
+    }
+
+    return score > 0 ? score - level : score + level;
+}
+
+int32_t alpha_beta(search_worker& worker, int8_t depth, int8_t level, int32_t alpha, int32_t beta, bool can_null_move=true) {
+    worker.pv_length[level] = level;
+
+    if (stop_search(worker)) {
+        return SCORE_NONE;
+    }
+
+    chess::Board& board = worker.board;
+    std::vector<chess::Move>& move_stack = worker.move_stack;
+    transposition_table& position_table = *worker.context.table;
+
+    worker.nodes.store(worker.nodes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    int32_t alpha_orig = alpha;
+    int32_t score = SCORE_NONE;
+
+    bool pv_node = (beta - alpha) > 1;
+
+    if (level != 0) {
+        alpha = std::max(alpha, (int32_t)(-CHECKMATE_SCORE + level));
+        beta = std::min(beta, (int32_t)(CHECKMATE_SCORE - level - 1));
+
+        if (alpha >= beta) {
+            return alpha;
+        }
+
+        if (is_cheap_draw(board)) {
+            return 0;
+        }
+    }
+
+    CHECK_HASH(board);
+    uint64_t pt_hash = board.hash();
+    position_table_entry pt_entry;
+    chess::Move pt_best_move = chess::Move::NO_MOVE;
+
+    // MultiPV lines and searchmoves search the root without some of its moves, so they
+    // can't take the root's table result and keep their partial results out of the table
+    bool excluding_root_moves = level == 0 && !worker.excluded_root_moves.empty();
+
+    bool pt_entry_exists = position_table.probe(pt_hash, pt_entry);
+    if (pt_entry_exists) {
+        int32_t pt_value = score_from_tt(pt_entry.value, level);
+
+        if (pt_entry.leaf_distance >= depth && !pv_node && !excluding_root_moves) {
+            if (pt_entry.flag == pt_flag::LOWER && pt_value >= beta) {
+                return beta;
+            }
+            else if (pt_entry.flag == pt_flag::UPPER && pt_value <= alpha) {
+                return alpha;
+            }
+            else if (pt_entry.flag == pt_flag::EXACT) {
+                return pt_value;
+            }
+        }
+
+        pt_best_move = pt_entry.best_move;
+        score = pt_value;
+    }
+
+    if (depth <= 0) {
+        return quiescence(worker, depth, level, alpha, beta);
+    }
+
+    bool futility_prunable = false;
+
+    bool is_check = board.inCheck();
+
+    if (!pv_node && !is_check) {
+        if (can_null_move && level != 0 && depth >= 3) {
+            if (score == SCORE_NONE) {
+                score = score_board(worker);
+            }
+
+            int16_t nmp_reduction = (int16_t)(3.0 + (float)depth / 3.0 + std::min((float)(score - beta)/200.0, 3.0));
+            
+            
+            if (nmp_reduction > 0) {
+                make_null_move(worker);
+
+                score = alpha_beta(worker, depth - nmp_reduction, level+1, -beta, -beta+1, false);
+
+                unmake_null_move(worker);
+
+                if (score == SCORE_NONE) {
+                    return SCORE_NONE;
+                }
+
+                score = -score;
+
+                if (score >= beta && !IS_MATE_SCORE(score)) {
+                    return beta;
+                }
+            }
+        }
+
+        if (depth <= FUTILITY_DEPTH) {
+            if (score == SCORE_NONE) {
+                score = score_board(worker);
+            }
+
+            if ((score + FUTILITY_MARGINS[depth]) < alpha) {
+                futility_prunable = true;
+            }
+        }
+
+        if (depth <= REVERSE_FUTILITY_DEPTH) {
+            if (score == SCORE_NONE) {
+                score = score_board(worker);
+            }
+            
+            if ((score - REVERSE_FUTILITY_MARGINS[depth]) > beta) {
+                return score;
+            }
+        }
+    }
+
+    uint8_t move_count = 0;
+    chess::Move best_move = chess::Move::NO_MOVE;
+    int32_t best_score = -CHECKMATE_SCORE-1;
+    move_picker picker(worker, level, pt_best_move);
+
+    chess::Move move;
+
+    while ((move = picker.next()) != chess::Move::NO_MOVE) {
+        if (excluding_root_moves && std::find(worker.excluded_root_moves.begin(), worker.excluded_root_moves.end(), move) != worker.excluded_root_moves.end()) {
+            continue;
+        }
+
+        move_count++;
+
+        if (futility_prunable && !IS_MATE_SCORE(alpha) && !IS_MATE_SCORE(beta) && !is_check && is_quiet_move(board, move)) {
+            continue;
+        }
+
+        int8_t reduction = 0;
+
+        if (move_count >= (LATE_MOVE_REDUCTION_MOVES + ((uint8_t)pv_node*2)) && !is_check && depth >= LATE_MOVE_REDUCTION_LEAF_DISTANCE && is_quiet_move(board, move)) {
+            reduction = LATE_MOVE_REDUCTION_TABLE[
+                std::min(depth, (int8_t)(LATE_MOVE_REDUCTION_TABLE_SIZE-1))
+            ][
+                std::min(move_count, (uint8_t)(LATE_MOVE_REDUCTION_TABLE_SIZE-1))
+            ];
+        }
+
+        make_move(worker, move);
+
+        score = alpha_beta(worker, depth-1-reduction, level+1, -alpha-1, -alpha);
+
+        unmake_move(worker, move);
+
+        if (score == SCORE_NONE) {
+            return SCORE_NONE;
+        }
+
+        score = -score;
+
+        if ((score > alpha) && (score < beta)) {
+            make_move(worker, move);
+
+            score = alpha_beta(worker, depth-1, level+1, -beta, -alpha);
+  
+            unmake_move(worker, move);
+
+            if (score == SCORE_NONE) {
+                return SCORE_NONE;
+            }
+
+            score = -score;
+        }
+
+        if (score >= beta) {
+            if (!is_check && is_quiet_move(board, move)) {
+                chess::Move* killers = worker.killer_moves[level];
+
+                if (killers[0] != move) {
+                    std::copy_backward(killers, killers + MAX_KILLER_MOVES - 1, killers + MAX_KILLER_MOVES);
+                    killers[0] = move;
+                }
+
+                worker.history_table[board.sideToMove()][move.from().index()][move.to().index()] += depth*depth;
+
+                if (worker.history_table[board.sideToMove()][move.from().index()][move.to().index()] >= MAX_HISTORY_VALUE) {
+                    shrink_history(worker.history_table);
+                }
+
+                if (!move_stack.empty() && move_stack.back() != chess::Move::NULL_MOVE) {
+                    worker.countermove_table[move_stack.back().from().index()][move_stack.back().to().index()] = move;
+                }
+            }
+
+            if (!excluding_root_moves) {
+                position_table.store(pt_hash, score_to_tt(beta, level), move, pt_flag::LOWER, depth);
+            }
+
+            if (level == 0) {
+                worker.root_best_move = move;
+            }
+
+            return beta;
+        }
+
+        if (score > best_score) {
+            best_score = score;
+            best_move = move;
+
+            if (score > alpha) {
+                alpha = score;
+
+                // This move followed by the line the child just found
+                worker.pv_table[level][level] = move;
+                std::copy(&worker.pv_table[level+1][level+1], &worker.pv_table[level+1][worker.pv_length[level+1]], &worker.pv_table[level][level+1]);
+                worker.pv_length[level] = worker.pv_length[level+1];
+            }
+        }
+    }
+
+    if (move_count == 0) {
+        score = is_check ? -CHECKMATE_SCORE + level : 0;
+        position_table.store(pt_hash, score_to_tt(score, level), chess::Move::NO_MOVE, pt_flag::EXACT, depth);
+
+        return score;
+    }
+
+    if (!excluding_root_moves) {
+        position_table.store(
+            pt_hash,
+            score_to_tt(alpha, level),
+            best_move,
+            (alpha <= alpha_orig) ? pt_flag::UPPER : pt_flag::EXACT,
+            depth
+        );
+    }
+
+    if (level == 0) {
+        worker.root_best_move = best_move;
+    }
+
+    return alpha;
+}
+
+// Full moves until mate for mate scores, negative when getting mated, zero otherwise
+int32_t mate_in(int32_t score) {
+    if (!IS_MATE_SCORE(score)) {
+        return 0;
+    }
+
+    int32_t plies = CHECKMATE_SCORE - std::abs(score);
+    return (plies + 1) / 2 * COLOR_MOD[score < 0];
+}
+
+// Searches the root in an aspiration window around gamma, widening the failed side until
+// the score lands inside. gamma follows the returned scores.
+int32_t aspiration_search(search_worker& worker, int8_t depth, int32_t& gamma) {
+    int32_t aspw_lower = -ASPIRATION_WINDOW_DEFAULT;
+    int32_t aspw_higher = ASPIRATION_WINDOW_DEFAULT;
+    int32_t score = 0;
+
+    if (depth >= ASPIRATION_WINDOW_DEPTH) {
+        while (true) {
+            int32_t alpha = gamma + aspw_lower;
+            int32_t beta = gamma + aspw_higher;
+            score = alpha_beta(worker, depth, 0, alpha, beta);
+
+            if (score == SCORE_NONE) {
+                break;
+            }
+
+            gamma = score;
+
+            if (score <= alpha) {
+                aspw_lower *= ASPIRATION_INCREASE_EXPONENT;
+            }
+            else if (score >= beta) {
+                aspw_higher *= ASPIRATION_INCREASE_EXPONENT;
+            }
+            else {
+                break;
+            }
+        }
+    }
+    else {
+        score = alpha_beta(worker, depth, 0, -CHECKMATE_SCORE, CHECKMATE_SCORE);
+        gamma = score;
+    }
+
+    return score;
+}
+
+// Root moves left out by a searchmoves list, none if the list is empty or holds no legal move
+std::vector<chess::Move> root_filtered_moves(const chess::Movelist& root_moves, const std::vector<chess::Move>& searchmoves) {
+    std::vector<chess::Move> filtered;
+
+    for (chess::Move move : root_moves) {
+        if (std::find(searchmoves.begin(), searchmoves.end(), move) == searchmoves.end()) {
+            filtered.push_back(move);
+        }
+    }
+
+    if (filtered.size() == (size_t)root_moves.size()) {
+        filtered.clear();
+    }
+
+    return filtered;
+}
+
+void iterative_deepening(search_worker& worker) {
+    search_context& context = worker.context;
+    bool main_thread = worker.id == 0;
+
+    // Helpers start on alternating depths so the threads spread over different subtrees
+    int8_t depth = STARTING_DEPTH + (worker.id % 2);
+    int8_t max_depth = context.limits.depth > 0 ? std::min(context.limits.depth, MAX_DEPTH - 1) : MAX_DEPTH - 1;
+
+    // searchmoves is the inverse of the MultiPV exclusion, every other root move is left out
+    chess::Movelist root_moves;
+    chess::movegen::legalmoves(root_moves, worker.board);
+    std::vector<chess::Move> filtered_root_moves = root_filtered_moves(root_moves, context.limits.searchmoves);
+
+    // One MultiPV line per root move at most
+    size_t searched_root_moves = root_moves.size() - filtered_root_moves.size();
+    size_t line_count = std::clamp((size_t)context.multipv, (size_t)1, std::max(searched_root_moves, (size_t)1));
+
+    std::vector<int32_t> gammas(line_count, score_board(worker));
+
+    // Time manager state, only used by the main thread
+    chess::Move previous_best_move = chess::Move::NO_MOVE;
+    int32_t previous_score = SCORE_NONE;
+    int32_t best_move_stability = 0;
+    uint64_t previous_iteration_nodes = 0;
+
+    while (!stop_search(context) && depth <= max_depth) {
+        int64_t iteration_start = now_ms();
+        uint64_t iteration_start_nodes = context.total_nodes();
+
+        worker.seldepth = 0;
+        worker.excluded_root_moves = filtered_root_moves;
+
+        std::vector<search_info> lines;
+
+        // Every line searches the root without the moves of the lines before it, all
+        // sharing the position table and move ordering heuristics
+        for (size_t slot = 0; slot < line_count; slot++) {
+            int32_t score = aspiration_search(worker, depth, gammas[slot]);
+
+            if (score == SCORE_NONE) {
+                break;
+            }
+
+            search_info line;
+            line.depth = depth;
+            line.score = score;
+            line.mate = mate_in(score);
+
+            // A root fail low leaves no line, the best move alone is still the PV
+            if (worker.pv_length[0] > 0 && worker.pv_table[0][0] == worker.root_best_move) {
+                line.pv.assign(&worker.pv_table[0][0], &worker.pv_table[0][worker.pv_length[0]]);
+            }
+            else if (worker.root_best_move != chess::Move::NO_MOVE) {
+                line.pv.assign(1, worker.root_best_move);
+            }
+
+            lines.push_back(line);
+            worker.excluded_root_moves.push_back(worker.root_best_move);
+        }
+
+        if (lines.size() < line_count) {
+            break;
+        }
+
+        // A later line can come back higher than an earlier one
+        std::stable_sort(lines.begin(), lines.end(), [](const search_info& a, const search_info& b) {
+            return a.score > b.score;
+        });
+
+        for (size_t i = 0; i < lines.size(); i++) {
+            lines[i].multipv = i + 1;
+            lines[i].seldepth = worker.seldepth;
+        }
+
+        worker.root_lines = lines;
+        int32_t score = lines[0].score;
+
+        if (!lines[0].pv.empty()) {
+            worker.best_move = lines[0].pv[0];
+            worker.best_score = score;
+            worker.completed_depth = depth;
+        }
+
+        if (main_thread && context.on_info) {
+            for (search_info& info : lines) {
+                info.nodes = context.total_nodes();
+                info.time = now_ms()-context.start_time;
+                info.nps = info.nodes * 1000 / std::max(info.time, (int64_t)1);
+                info.hashfull = context.table->hashfull();
+
+                context.on_info(info);
+            }
+        }
+
+        if (main_thread) {
+            if (context.limits.mate && mate_in(score) > 0 && mate_in(score) <= context.limits.mate) {
+                break;
+            }
+
+            best_move_stability = worker.best_move == previous_best_move ? best_move_stability + 1 : 0;
+
+            uint64_t iteration_nodes = context.total_nodes() - iteration_start_nodes;
+            double branching_factor = previous_iteration_nodes ? std::clamp((double)iteration_nodes / previous_iteration_nodes, 1.0, TIME_MAX_BRANCHING_FACTOR) : TIME_MAX_BRANCHING_FACTOR;
+
+            if (!start_next_iteration(context, best_move_stability, previous_score == SCORE_NONE ? 0 : previous_score - score, now_ms() - iteration_start, branching_factor)) {
+                break;
+            }
+
+            previous_best_move = worker.best_move;
+            previous_score = score;
+            previous_iteration_nodes = iteration_nodes;
+        }
+
+        depth += 1;
+    }
+}
+
+void reset_worker(search_worker& worker) {
+    worker.board = worker.context.board;
+    worker.move_stack.clear();
+    refresh_accumulator(worker.accumulators[0], worker.board);
+    worker.network = worker.context.use_nnue ? worker.context.network.get() : nullptr;
+
+    if (worker.network) {
+        refresh_nnue_accumulator(*worker.network, worker.nnue_accumulators[0], worker.board);
+    }
+
+    worker.nodes = 0;
+    worker.seldepth = 0;
+    worker.stop_check_countdown = 0;
+    worker.pawn_table_probes = 0;
+    worker.pawn_table_hits = 0;
+
+    memset(&worker.killer_moves, 0, sizeof(worker.killer_moves));
+    memset(&worker.countermove_table, 0, sizeof(worker.countermove_table));
+    memset(&worker.history_table, 0, sizeof(worker.history_table));
+
+    worker.root_best_move = chess::Move::NO_MOVE;
+    worker.best_move = chess::Move::NO_MOVE;
+    worker.root_lines.clear();
+    worker.excluded_root_moves.clear();
+    worker.best_score = 0;
+    worker.completed_depth = 0;
+}
+
+// Lazy SMP: every worker runs its own iterative deepening on a copy of the root
+// and they cooperate only through the shared position table.
+search_result search(search_context& context) {
+    std::vector<std::unique_ptr<search_worker>>& workers = context.workers;
+
+    context.start_time = now_ms();
+    context.clock_start = context.start_time;
+    start_time_manager(context);
+
+    // Entries from earlier searches stay usable but become the first to be replaced
+    context.table->new_search();
+
+    for (std::unique_ptr<search_worker>& worker : workers) {
+        reset_worker(*worker);
+    }
+
+    std::vector<std::thread> helper_threads;
+
+    for (size_t i = 1; i < workers.size(); i++) {
+        helper_threads.emplace_back(iterative_deepening, std::ref(*workers[i]));
+    }
+
+    iterative_deepening(*workers[0]);
+
+    // Infinite searches only return once stopped and ponder searches once stopped or hit,
+    // even after reaching the maximum depth
+    while ((context.limits.infinite || context.pondering) && !stop_search(context)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    context.stop = true;
+
+    for (std::thread& helper_thread : helper_threads) {
+        helper_thread.join();
+    }
+
+    // Take the deepest completed iteration, preferring the higher score on ties
+    search_worker* best_worker = workers[0].get();
+
+    for (std::unique_ptr<search_worker>& worker : workers) {
+        if (worker->best_move == chess::Move::NO_MOVE) {
+            continue;
+        }
+
+        if (
+            best_worker->best_move == chess::Move::NO_MOVE ||
+            worker->completed_depth > best_worker->completed_depth ||
+            (worker->completed_depth == best_worker->completed_depth && worker->best_score > best_worker->best_score)
+        ) {
+            best_worker = worker.get();
+        }
+    }
+
+    search_result result;
+    result.best_move = best_worker->best_move;
+    result.score = best_worker->best_score;
+    result.depth = best_worker->completed_depth;
+    result.mate = mate_in(result.score);
+    result.nodes = context.total_nodes();
+    result.time = now_ms() - context.start_time;
+
+    for (std::unique_ptr<search_worker>& worker : workers) {
+        result.pawn_table_probes += worker->pawn_table_probes;
+        result.pawn_table_hits += worker->pawn_table_hits;
+    }
+
+    if (result.best_move == chess::Move::NO_MOVE) {
+        search_worker& worker = *workers[0];
+        chess::Movelist moves;
+        chess::movegen::legalmoves(moves, worker.board);
+
+        if (!moves.empty()) {
+            sort_moves(worker, moves, 0);
+            std::vector<chess::Move> filtered = root_filtered_moves(moves, context.limits.searchmoves);
+
+            for (chess::Move move : moves) {
+                if (std::find(filtered.begin(), filtered.end(), move) == filtered.end()) {
+                    result.best_move = move;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (!best_worker->root_lines.empty() && !best_worker->root_lines[0].pv.empty() && best_worker->root_lines[0].pv[0] == result.best_move) {
+        result.pv = best_worker->root_lines[0].pv;
+        result.lines = best_worker->root_lines;
+    }
+    else if (result.best_move != chess::Move::NO_MOVE) {
+        result.pv.push_back(result.best_move);
+    }
+
+    return result;
+}
+
+engine::engine(size_t hash_mb, int32_t thread_count) : engine(make_shared_table(hash_mb), thread_count) {}
+
+engine::engine(std::shared_ptr<transposition_table> shared_table, int32_t thread_count) : context(std::make_unique<search_context>(shared_table, thread_count)) {}
+
+engine::~engine() {
+    stop();
+    wait();
+}
+
+std::future<search_result> engine::analyse(const chess::Board& board, const search_limits& limits, search_info_callback on_info, cancellation_token token) {
+    wait();
+
+    context->board = board;
+    context->limits = limits;
+    context->on_info = on_info;
+    context->cancel = token;
+    context->pondering = limits.ponder;
+    context->stop = false;
+
+    std::promise<search_result> promise;
+    std::future<search_result> result = promise.get_future();
+
+    search_thread = std::thread([this](std::promise<search_result> promise) {
+        promise.set_value(search(*context));
+    }, std::move(promise));
+
+    return result;
+}
+
+void engine::stop() {
+    context->stop = true;
+}
+
+void engine::ponderhit() {
+    if (context->pondering) {
+        context->clock_start = now_ms();
+        context->pondering = false;
+    }
+}
+
+void engine::wait() {
+    if (search_thread.joinable()) {
+        search_thread.join();
+    }
+}
+
+bool engine::searching() const {
+    return !context->stop;
+}
+
+// A stopped search still reads its workers, table and network until its thread finishes,
+// so the setters wait for it before changing any of them
+bool engine::idle() {
+    if (searching()) {
+        return false;
+    }
+
+    wait();
+    return true;
+}
+
+setting_result engine::set_hash_size(size_t megabytes) {
+    if (!idle()) {
+        return setting_result::BUSY;
+    }
+
+    return context->table->resize(megabytes) ? setting_result::APPLIED : setting_result::FAILED;
+}
+
+void engine::clear_hash() {
+    if (idle()) {
+        context->table->clear();
+    }
+}
+
+void engine::set_thread_count(int32_t thread_count) {
+    if (idle()) {
+        context->set_thread_count(thread_count);
+    }
+}
+
+size_t engine::thread_count() const {
+    return context->workers.size();
+}
+
+setting_result engine::load_network(const std::string& path) {
+    if (!idle()) {
+        return setting_result::BUSY;
+    }
+
+    std::shared_ptr<const nnue_network> network = load_network_file(path);
+
+    if (!network) {
+        return setting_result::FAILED;
+    }
+
+    context->network = network;
+    return setting_result::APPLIED;
+}
+
+void engine::set_use_nnue(bool use_nnue) {
+    if (idle()) {
+        context->use_nnue = use_nnue;
+    }
+}
+
+void engine::set_multipv(int32_t multipv) {
+    if (idle()) {
+        context->multipv = std::clamp(multipv, 1, MAX_MULTIPV);
+    }
+}
+
+void engine::set_move_overhead(int32_t move_overhead) {
+    if (idle()) {
+        context->move_overhead = std::max(move_overhead, 0);
+    }
+}
+
+bool engine::using_nnue() const {
+    return context->use_nnue && context->network;
+}
+
+// Fixed suite for bench, openings through endgames plus a few mates and stalemates
+static const char* BENCH_FENS[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3",
+    "rnbqkb1r/ppp1pppp/5n2/3p4/3P4/2N5/PPP1PPPP/R1BQKBNR w KQkq - 2 3",
+    "r1bqk2r/pppp1ppp/2n2n2/2b1p3/2B1P3/3P1N2/PPP2PPP/RNBQK2R w KQkq - 1 5",
+    "rnbqkb1r/pp1p1ppp/2p5/4P3/2B5/8/PPP1NnPP/RNBQK2R w KQkq - 0 6",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1bq1rk1/ppp1nppp/4n3/3p3Q/3P4/1BP1B3/PP1N2PP/R4RK1 w - - 1 16",
+    "4r1k1/r1q2ppp/ppp2n2/4P3/5Rb1/1N1BQ3/PPP3PP/R5K1 w - - 1 17",
+    "2rqkb1r/ppp2p2/2npb1p1/1N1Nn2p/2P1PP2/8/PP2B1PP/R1BQK2R b KQ - 0 11",
+    "r1bq1r1k/b1p1npp1/p2p3p/1p6/3PP3/1B2NN2/PP3PPP/R2Q1RK1 w - - 1 16",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "r1q2rk1/2p1bppp/2Pp4/p6b/Q1PNp3/4B3/PP1R1PPP/2K4R w - - 2 18",
+    "4k2r/1pb2ppp/1p2p3/1R1p4/3P4/2r1PN2/P4PPP/1R4K1 b - - 3 22",
+    "3q2k1/pb3p1p/4pbp1/2r5/PpN2N2/1P2P2P/5PP1/Q2R2K1 b - - 4 26",
+    "r3k2r/3nnpbp/q2pp1p1/p7/Pp1PPPP1/4BNN1/1P5P/R2Q1RK1 w kq - 0 16",
+    "4rrk1/1p1nq3/p7/2p1P1pp/3P2bp/3Q1Bn1/PPPB4/1K2R1NR w - - 40 21",
+    "3Qb1k1/1r2ppb1/pN1n2q1/Pp1Pp1Pr/4P2p/4BP2/4B1R1/1R5K b - - 11 40",
+    "4k3/3q1r2/1N2r1b1/3ppN2/2nPP3/1B1R2n1/2R1Q3/3K4 w - - 5 1",
+    "5rk1/q6p/2p3bR/1pPp1rP1/1P1Pp3/P3B1Q1/1K3P2/R7 w - - 93 90",
+    "6k1/3b3r/1p1p4/p1n2p2/1PPNpP1q/P3Q1p1/1R1RB1P1/5K2 b - - 0 1",
+    "r2r1n2/pp2bk2/2p1p2p/3q4/3PN1QP/2P3R1/P4PP1/5RK1 w - - 0 1",
+    "1r3k2/4q3/2Pp3b/3Bp3/2Q2p2/1p1P2P1/1P2KP2/3N4 w - - 0 1",
+    "6k1/4pp1p/3p2p1/P1pPb3/R7/1r2P1PP/3B1P2/6K1 w - - 0 1",
+    "6k1/6p1/P6p/r1N5/5p2/7P/1b3PP1/4R1K1 w - - 0 1",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+    "2K5/p7/7P/5pR1/8/5k2/r7/8 w - - 0 1",
+    "8/6pk/1p6/8/PP3p1p/5P2/4KP1q/3Q4 w - - 0 1",
+    "7k/3p2pp/4q3/8/4Q3/5Kp1/P6b/8 w - - 0 1",
+    "8/2p5/8/2kPKp1p/2p4P/2P5/3P4/8 w - - 0 1",
+    "8/1p3pp1/7p/5P1P/2k3P1/8/2K2P2/8 w - - 0 1",
+    "8/pp2r1k1/2p1p3/3pP2p/1P1P1P1P/P5KR/8/8 w - - 0 1",
+    "8/3p4/p1bk3p/Pp6/1Kp1PpPp/2P2P1P/2P5/5B2 b - - 0 1",
+    "5k2/7R/4P2p/5K2/p1r2P1p/8/8/8 b - - 0 1",
+    "8/3p3B/5p2/5P2/p7/PP5b/k7/6K1 w - - 0 1",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1",
+    "8/8/8/5N2/8/p7/8/2NK3k w - - 0 1",
+    "8/3k4/8/8/8/4B3/4KB2/2B5 w - - 0 1",
+    "8/8/1P6/5pr1/8/4R3/7k/2K5 w - - 0 1",
+    "8/2p4P/8/kr6/6R1/8/8/1K6 w - - 0 1",
+    "8/8/3P3k/8/1p6/8/1P6/1K3n2 b - - 0 1",
+    "8/R7/2q5/8/6k1/8/1P5p/K6R w - - 0 124",
+    "6k1/5ppp/8/8/8/8/5PPP/R5K1 w - - 0 1",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p2Q/2B1P3/8/PPPP1PPP/RNB1K1NR w KQkq - 4 4",
+    "8/8/8/8/8/6k1/6p1/6K1 w - - 0 1",
+    "7k/7P/6K1/8/3B4/8/8/8 b - - 0 1",
+};
+
+// Searches every bench position to a fixed depth from a clean table. The total node
+// count is a signature of the search, any functional change shows up in it.
+void bench(int32_t depth, int32_t thread_count, size_t hash_mb) {
+    std::shared_ptr<transposition_table> table = make_shared_table(hash_mb);
+
+    search_context context(table, thread_count);
+    context.limits.depth = std::clamp(depth, 1, MAX_DEPTH - 1);
+
+    uint64_t nodes = 0;
+    int64_t start_time = now_ms();
+    size_t position_count = sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]);
+
+    for (size_t i = 0; i < position_count; i++) {
+        context.board = chess::Board::fromFen(BENCH_FENS[i]);
+        table->clear();
+
+        context.stop = false;
+        chess::Move bestmove = search(context).best_move;
+
+        uint64_t position_nodes = context.total_nodes();
+        nodes += position_nodes;
+
+        std::cout << std::format("info string bench {}/{} nodes {} bestmove {}", i + 1, position_count, position_nodes, bestmove == chess::Move::NO_MOVE ? "0000" : chess::uci::moveToUci(bestmove)) << std::endl;
+    }
+
+    int64_t elapsed = std::max(now_ms() - start_time, (int64_t)1);
+
+    // How long a movetime search runs past its deadline before returning
+    context.board = chess::Board::fromFen(BENCH_FENS[0]);
+    context.limits = search_limits();
+    context.limits.movetime = BENCH_STOP_MOVETIME;
+    table->clear();
+
+    context.stop = false;
+    int64_t stop_latency = search(context).time - context.maximum_time;
+
+    std::cout << "===========================" << std::endl;
+    std::cout << "Total time (ms) : " << elapsed << std::endl;
+    std::cout << "Nodes searched  : " << nodes << std::endl;
+    std::cout << "Nodes/second    : " << nodes * 1000 / elapsed << std::endl;
+    std::cout << "Stop latency(ms): " << stop_latency << std::endl;
+}
+
+
+// Board from a FEN or EPD line, EPD lines carry no move counters and may be followed by
+// operations, so only the first four fields are trusted
+enum position_line_status {
+    POSITION_LINE_SKIPPED,
+    POSITION_LINE_INVALID,
+    POSITION_LINE_VALID
+};
+
+// Blank and # lines are skipped, anything else must be a legal position
+position_line_status parse_position_line(const std::string& line, chess::Board& board) {
+    std::istringstream line_stream(line);
+    std::string fields[6];
+    uint8_t field_count = 0;
+
+    while (field_count < 6 && line_stream >> fields[field_count]) {
+        field_count++;
+    }
+
+    if (field_count == 0 || fields[0][0] == '#') {
+        return POSITION_LINE_SKIPPED;
+    }
+
+    // The board asserts on a missing king, so count them before parsing
+    if (field_count < 4 || std::count(fields[0].begin(), fields[0].end(), 'K') != 1 || std::count(fields[0].begin(), fields[0].end(), 'k') != 1) {
+        return POSITION_LINE_INVALID;
+    }
+
+    std::string fen = fields[0] + " " + fields[1] + " " + fields[2] + " " + fields[3];
+
+    bool has_counters = field_count == 6
+        && std::all_of(fields[4].begin(), fields[4].end(), ::isdigit)
+        && std::all_of(fields[5].begin(), fields[5].end(), ::isdigit);
+
+    fen += has_counters ? " " + fields[4] + " " + fields[5] : " 0 1";
+
+    chess::Board parsed;
+
+    if (!parsed.setFen(fen) || parsed.isAttacked(parsed.kingSq(~parsed.sideToMove()), parsed.sideToMove())) {
+        return POSITION_LINE_INVALID;
+    }
+
+    board = parsed;
+    return POSITION_LINE_VALID;
+}
+
+std::string format_batch_error(batch_format format, uint64_t line_number, const std::string& error) {
+    if (format == batch_format::CSV) {
+        return std::format("{},,,,,,,,{}", line_number, error);
+    }
+
+    return std::format("{{\"line\":{},\"error\":\"{}\"}}", line_number, error);
+}
+
+std::string format_batch_record(batch_format format, uint64_t line_number, const chess::Board& board, const search_result& result) {
+    std::string pv;
+    for (chess::Move move : result.pv) {
+        pv += (pv.empty() ? "" : " ") + chess::uci::moveToUci(move);
+    }
+
+    std::string bestmove = result.best_move == chess::Move::NO_MOVE ? "0000" : chess::uci::moveToUci(result.best_move);
+    std::string score_type = result.mate ? "mate" : "cp";
+    int32_t score = result.mate ? result.mate : result.score;
+
+    if (format == batch_format::CSV) {
+        return std::format("{},{},{},{},{},{},{},{},", line_number, board.getFen(), bestmove, score_type, score, result.depth, result.nodes, pv);
+    }
+
+    return std::format("{{\"line\":{},\"fen\":\"{}\",\"bestmove\":\"{}\",\"{}\":{},\"depth\":{},\"nodes\":{},\"pv\":\"{}\"}}", line_number, board.getFen(), bestmove, score_type, score, result.depth, result.nodes, pv);
+}
+
+// Every pool thread keeps one single threaded search context for the whole stream, so
+// tables and heuristics are allocated once. Records are written as soon as they finish
+// and carry their input line number, since they come out of order.
+uint64_t analyse_batch(std::istream& input, std::ostream& output, const search_limits& limits, batch_format format, int32_t thread_count, size_t hash_mb) {
+    std::mutex input_mutex;
+    std::mutex output_mutex;
+    uint64_t line_number = 0;
+    std::atomic<uint64_t> positions = 0;
+    std::atomic<uint64_t> invalid_lines = 0;
+    std::atomic<uint64_t> nodes = 0;
+    int64_t start_time = now_ms();
+
+    if (format == batch_format::CSV) {
+        output << "line,fen,bestmove,score_type,score,depth,nodes,pv,error" << std::endl;
+    }
+
+    auto batch_worker = [&]() {
+        std::shared_ptr<transposition_table> table = make_shared_table(hash_mb);
+
+        search_context context(table, 1);
+        context.limits = limits;
+
+        while (true) {
+            std::string line;
+            uint64_t position_line;
+
+            {
+                std::lock_guard<std::mutex> lock(input_mutex);
+
+                if (!std::getline(input, line)) {
+                    break;
+                }
+
+                position_line = ++line_number;
+            }
+
+            position_line_status status = parse_position_line(line, context.board);
+
+            if (status == POSITION_LINE_SKIPPED) {
+                continue;
+            }
+
+            // A bad line gets an error record instead of stopping the batch
+            if (status == POSITION_LINE_INVALID) {
+                std::string record = format_batch_error(format, position_line, "invalid fen");
+                invalid_lines.fetch_add(1, std::memory_order_relaxed);
+
+                std::lock_guard<std::mutex> lock(output_mutex);
+                output << record << '\n';
+                continue;
+            }
+
+            context.stop = false;
+            search_result result = search(context);
+
+            positions.fetch_add(1, std::memory_order_relaxed);
+            nodes.fetch_add(result.nodes, std::memory_order_relaxed);
+
+            std::string record = format_batch_record(format, position_line, context.board, result);
+
+            std::lock_guard<std::mutex> lock(output_mutex);
+            output << record << '\n';
+        }
+    };
+
+    std::vector<std::thread> threads;
+
+    for (int32_t i = 1; i < std::clamp(thread_count, 1, MAX_THREADS); i++) {
+        threads.emplace_back(batch_worker);
+    }
+
+    batch_worker();
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    output.flush();
+
+    int64_t elapsed = std::max(now_ms() - start_time, (int64_t)1);
+
+    std::cerr << std::format("analysed {} positions, {} invalid lines, {} nodes in {} ms, {} nps", positions.load(), invalid_lines.load(), nodes.load(), elapsed, nodes.load() * 1000 / elapsed) << std::endl;
+
+    return positions;
+}
+
+// Plays one self-play game from a random opening and collects its quiet positions,
+// labelled with the search score and, once the game is decided, its result
+void play_datagen_game(search_context& context, std::mt19937_64& rng, std::vector<datagen_record>& records) {
+    chess::Board& board = context.board;
+    records.clear();
+    context.table->clear();
+
+    // Random opening, played again if it runs into a finished game
+    while (true) {
+        board = chess::Board(chess::constants::STARTPOS);
+
+        for (uint8_t ply = 0; ply < DATAGEN_RANDOM_PLIES; ply++) {
+            chess::Movelist moves;
+            chess::movegen::legalmoves(moves, board);
+
+            if (moves.empty()) {
+                break;
+            }
+
+            board.makeMove(moves[rng() % moves.size()]);
+        }
+
+        chess::Movelist moves;
+        chess::movegen::legalmoves(moves, board);
+
+        if (!moves.empty()) {
+            break;
+        }
+    }
+
+    uint8_t result = DATAGEN_DRAW;
+    uint8_t decisive_plies = 0;
+
+    for (uint16_t ply = 0; ; ply++) {
+        chess::Movelist moves;
+        chess::movegen::legalmoves(moves, board);
+
+        if (moves.empty()) {
+            if (board.inCheck()) {
+                result = board.sideToMove() == chess::Color::WHITE ? DATAGEN_BLACK_WIN : DATAGEN_WHITE_WIN;
+            }
+            break;
+        }
+
+        if (is_cheap_draw(board) || ply >= DATAGEN_MAX_PLIES) {
+            break;
+        }
+
+        context.stop = false;
+        search_result found = search(context);
+
+        int32_t white_score = found.score * COLOR_MOD[board.sideToMove()];
+        uint8_t leader = white_score > 0 ? DATAGEN_WHITE_WIN : DATAGEN_BLACK_WIN;
+
+        // Forced mates and lasting large advantages end the game early
+        if (found.mate) {
+            result = leader;
+            break;
+        }
+
+        if (std::abs(white_score) >= DATAGEN_ADJUDICATE_SCORE) {
+            if (++decisive_plies >= DATAGEN_ADJUDICATE_PLIES) {
+                result = leader;
+                break;
+            }
+        }
+        else {
+            decisive_plies = 0;
+        }
 
-        if (futility_prunable && !IS_MATE_SCORE(alpha) && !IS_MATE_SCORE(beta) && !is_check && is_quiet_move(board, move)) {
-            continue;
+        // Positions in the middle of a tactic make poor labels
+        if (!board.inCheck() && !board.isCapture(found.best_move) && found.best_move.typeOf() != chess::Move::PROMOTION) {
+            records.push_back({chess::Board::Compact::encode(board), (int16_t)std::clamp(white_score, -32000, 32000), 0, 0});
         }
 
-        int8_t reduction = 0;
+        board.makeMove(found.best_move);
+    }
 
-        if (move_count >= (LATE_MOVE_REDUCTION_MOVES + ((uint8_t)pv_node*2)) && !is_check && depth >= LATE_MOVE_REDUCTION_LEAF_DISTANCE && is_quiet_move(board, move)) {
-            reduction = LATE_MOVE_REDUCTION_TABLE[
-                std::min(depth, (int8_t)(LATE_MOVE_REDUCTION_TABLE_SIZE-1))
-            ][
-                std::min(move_count, (uint8_t)(LATE_MOVE_REDUCTION_TABLE_SIZE-1))
-            ];
-        }
+    for (datagen_record& record : records) {
+        record.result = result;
+    }
+}
 
-        board.makeMove(move);
-        move_stack.push_back(move);
+// Every thread plays its own games with a private single threaded search and buffers
+// the records. Full buffers reserve a region of the output with one atomic add and are
+// written there through the thread's own file handle, so writers never wait on each other.
+uint64_t datagen(const std::string& path, int32_t thread_count, uint64_t nodes, uint64_t target_positions, uint64_t seed, size_t hash_mb) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+
+    if (file == nullptr) {
+        std::cerr << "failed to open " << path << std::endl;
+        return 0;
+    }
+
+    std::fclose(file);
+
+    thread_count = std::clamp(thread_count, 1, MAX_THREADS);
+
+    std::atomic<uint64_t> next_offset = 0;
+    std::atomic<uint64_t> positions = 0;
+    std::atomic<uint64_t> games = 0;
+    std::atomic<int32_t> running = thread_count;
+    int64_t start_time = now_ms();
 
-        if (board.isGameOver().second != chess::GameResult::NONE) {
-            score = (board.isGameOver().first == chess::GameResultReason::CHECKMATE) ? -CHECKMATE_SCORE + level : 0;
+    auto datagen_worker = [&](int32_t id) {
+        std::FILE* output = std::fopen(path.c_str(), "r+b");
+
+        if (output == nullptr) {
+            std::cerr << std::format("datagen thread {} failed to open {}\n", id, path);
+            running.fetch_sub(1);
+            return;
         }
-        else {
-            score = alpha_beta(board, move_stack, depth-1-reduction, level+1, -alpha-1, -alpha);
+
+        std::mt19937_64 rng(seed + id);
+
+        std::shared_ptr<transposition_table> table = make_shared_table(hash_mb);
+
+        search_context context(table, 1);
+        context.limits.nodes = nodes;
+
+        std::vector<datagen_record> game_records;
+        std::vector<datagen_record> buffer;
+        buffer.reserve(DATAGEN_BUFFER_RECORDS);
+
+        auto flush = [&]() {
+            uint64_t offset = next_offset.fetch_add(buffer.size() * sizeof(datagen_record));
+
+#if defined(_WIN32)
+            _fseeki64(output, offset, SEEK_SET);
+#else
+            fseeko(output, offset, SEEK_SET);
+#endif
+            std::fwrite(buffer.data(), sizeof(datagen_record), buffer.size(), output);
+            buffer.clear();
+        };
+
+        while (positions.load(std::memory_order_relaxed) < target_positions) {
+            play_datagen_game(context, rng, game_records);
+
+            buffer.insert(buffer.end(), game_records.begin(), game_records.end());
+            positions.fetch_add(game_records.size(), std::memory_order_relaxed);
+            games.fetch_add(1, std::memory_order_relaxed);
+
+            if (buffer.size() >= DATAGEN_BUFFER_RECORDS) {
+                flush();
+            }
         }
 
-        board.unmakeMove(move);
-        move_stack.pop_back();
+        flush();
+        std::fclose(output);
+        running.fetch_sub(1);
+    };
 
-        if (score == SCORE_NONE) {
-            return SCORE_NONE;
+    auto report = [&]() {
+        int64_t elapsed = std::max(now_ms() - start_time, (int64_t)1);
+        uint64_t positions_per_second = positions.load() * 1000 / elapsed;
+
+        std::cerr << std::format("games {} positions {} time {} s {} pos/s {} pos/h", games.load(), positions.load(), elapsed / 1000, positions_per_second, positions_per_second * 3600) << std::endl;
+    };
+
+    std::vector<std::thread> threads;
+
+    for (int32_t i = 0; i < thread_count; i++) {
+        threads.emplace_back(datagen_worker, i);
+    }
+
+    int64_t last_report = now_ms();
+
+    while (running.load() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        if (now_ms() - last_report >= DATAGEN_REPORT_INTERVAL_MS) {
+            report();
+            last_report = now_ms();
         }
+    }
 
-        score = -score;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
 
-        if ((score > alpha) && (score < beta)) {
-            board.makeMove(move);
-            move_stack.push_back(move);
+    report();
 
-            score = alpha_beta(board, move_stack, depth-1, level+1, -beta, -alpha);
-  
-            board.unmakeMove(move);
-            move_stack.pop_back();
+    return positions;
+}
 
-            if (score == SCORE_NONE) {
-                return SCORE_NONE;
-            }
+// Tuner parameter layout, every parameter has a midgame and an endgame weight
+#define TUNE_POSITION_OFFSET 0
+#define TUNE_MATERIAL_OFFSET (TUNE_POSITION_OFFSET + 6 * 64)
+#define TUNE_MOBILITY_OFFSET (TUNE_MATERIAL_OFFSET + 5)
+#define TUNE_DOUBLED_PAWN (TUNE_MOBILITY_OFFSET + 6 * 28)
+#define TUNE_TRIPLED_PAWN (TUNE_DOUBLED_PAWN + 1)
+#define TUNE_ISOLATED_PAWN (TUNE_TRIPLED_PAWN + 1)
+#define TUNE_PASSED_PAWN (TUNE_ISOLATED_PAWN + 1)
+#define TUNE_DOUBLE_BISHOP (TUNE_PASSED_PAWN + 1)
+#define TUNE_OPEN_FILE_NEAR_KING (TUNE_DOUBLE_BISHOP + 1)
+#define TUNE_TEMPO (TUNE_OPEN_FILE_NEAR_KING + 1)
+#define TUNE_PARAMS (TUNE_TEMPO + 1)
+
+#define TUNE_K_MIN 0.1
+#define TUNE_K_MAX 4.0
+#define TUNE_K_ITERATIONS 40
+#define TUNE_REPORT_INTERVAL 10
+#define TUNE_SAVE_INTERVAL 50
+
+#define ADAM_BETA1 0.9
+#define ADAM_BETA2 0.999
+#define ADAM_EPSILON 1e-8
+
+typedef std::array<std::array<double, N_PHASES>, TUNE_PARAMS> tune_weights;
+
+static const char* PIECE_TYPE_NAMES[6] = {"Pawn", "Knight", "Bishop", "Rook", "Queen", "King"};
+
+// A position reduced to the phase, the untuned part of the eval and the sparse
+// white point of view coefficients of every parameter, stored per thread.
+// Positions as parallel arrays, the features of position i are the entries from
+// feature_starts[i] up to feature_starts[i + 1]
+struct tune_chunk {
+    std::vector<float> phases;
+    std::vector<float> bases;
+    std::vector<float> targets;
+    std::vector<float> scores; // search score of the record, white point of view
+    std::vector<uint32_t> feature_starts = {0};
+    std::vector<uint16_t> feature_indices;
+    std::vector<int8_t> feature_coefficients;
+
+    size_t size() const {
+        return phases.size();
+    }
+};
 
-            score = -score;
+// Mirrors score_board, the eval is linear in the weights within each phase
+void collect_eval_features(const chess::Board& board, tune_chunk& chunk) {
+    std::vector<std::pair<uint16_t, int8_t>> features;
+    int16_t phase_material = 0;
+    float base = 0;
+
+    chess::Bitboard pawn_attacks[N_PLAYERS];
+    uint8_t pawn_file_counts[N_PLAYERS][8] = {};
+
+    for (uint8_t color = 0; color < N_PLAYERS; color++) {
+        chess::Bitboard pawns = board.pieces(chess::PieceType::PAWN, chess::Color(color));
+
+        while (pawns) {
+            chess::Square square = pawns.pop();
+            pawn_attacks[color] |= chess::attacks::pawn(chess::Color(color), square);
+            pawn_file_counts[color][square.file()]++;
         }
+    }
 
-        if (score >= beta) {
-            if (!is_check && is_quiet_move(board, move)) {
-                killer_moves[level].push_front(move);
+    for (uint8_t color = 0; color < N_PLAYERS; color++) {
+        chess::Color side = chess::Color(color);
+        int8_t color_mod = COLOR_MOD[color];
 
-                if (killer_moves[level].size() > MAX_KILLER_MOVES) {
-                    killer_moves[level].pop_back();
-                }
+        chess::Bitboard safe = ~board.us(side) & ~pawn_attacks[~side];
+        chess::Bitboard enemy_pawns = board.pieces(chess::PieceType::PAWN, ~side);
+        chess::Bitboard pieces = board.us(side);
 
-                history_table[board.sideToMove()][move.from().index()][move.to().index()] += depth*depth;
+        while (pieces) {
+            chess::Square square = pieces.pop();
+            chess::PieceType type = board.at<chess::PieceType>(square);
+            chess::Square pov_square = square.relative_square(side);
 
-                if (history_table[board.sideToMove()][move.from().index()][move.to().index()] >= MAX_HISTORY_VALUE) {
-                    shrink_history(history_table);
-                }
+            base += (uint8_t)pov_square.rank() * WILL_TO_PUSH * color_mod;
+            phase_material += PHASE_PIECE_WEIGHTS[type];
 
-                if (move_stack.size() >= 2) {
-                    countermove_table[move_stack[-2].from().index()][move_stack[-2].to().index()] = move;
-                }
-            }
+            features.emplace_back(TUNE_POSITION_OFFSET + type * 64 + pov_square.index(), color_mod);
+            features.emplace_back(TUNE_MOBILITY_OFFSET + type * 28 + piece_mobility(board, type, side, square, safe), color_mod);
 
-            if (pt_entry_exists || (position_table.size() < MAX_PTABLE_SIZE)) {
-                position_table[pt_hash] = {beta, move, pt_flag::LOWER, depth};
+            if (type != chess::PieceType::KING) {
+                features.emplace_back(TUNE_MATERIAL_OFFSET + type, color_mod);
             }
 
-            return beta;
+            if (type == chess::PieceType::PAWN && (uint8_t)square.file() < 7 && (PASSING_FIELDS[color][square.index()] & enemy_pawns).empty()) {
+                features.emplace_back(TUNE_PASSED_PAWN, color_mod);
+            }
         }
 
-        if (score > best_score) {
-            best_score = score;
-            best_move = move;
+        uint8_t open_files = 0;
 
-            if (score > alpha) {
-                alpha = score;
+        for (uint8_t file = 0; file < 8; file++) {
+            uint8_t count = pawn_file_counts[color][file];
+
+            if (count == 0) {
+                open_files |= 1 << file;
+                continue;
+            }
+
+            if (count == 2) {
+                features.emplace_back(TUNE_DOUBLED_PAWN, color_mod);
+            }
+            else if (count >= 3) {
+                features.emplace_back(TUNE_TRIPLED_PAWN, color_mod);
+            }
+
+            if ((file == 0 || pawn_file_counts[color][file-1] == 0) && (file == 7 || pawn_file_counts[color][file+1] == 0)) {
+                features.emplace_back(TUNE_ISOLATED_PAWN, color_mod);
             }
         }
+
+        if (board.pieces(chess::PieceType::BISHOP, side).count() == 2) {
+            features.emplace_back(TUNE_DOUBLE_BISHOP, color_mod);
+        }
+
+        uint8_t king_file = board.kingSq(side).file();
+        uint8_t king_files = (0b111 << king_file >> 1) & 0xFF;
+
+        features.emplace_back(TUNE_OPEN_FILE_NEAR_KING, std::popcount((uint8_t)(open_files & king_files)) * color_mod);
     }
 
-    if (pt_entry_exists || (position_table.size() < MAX_PTABLE_SIZE)) {
-        position_table[pt_hash] = {
-            alpha,
-            best_move,
-            (alpha <= alpha_orig) ? pt_flag::UPPER : pt_flag::EXACT,
-            depth
-        };
+    features.emplace_back(TUNE_TEMPO, COLOR_MOD[board.sideToMove()]);
+
+    // Merge repeated parameters, a white and a black piece on mirrored squares cancel out
+    std::sort(features.begin(), features.end());
+
+    chunk.phases.push_back(material_phase(phase_material));
+    chunk.bases.push_back(base);
+
+    for (size_t i = 0; i < features.size();) {
+        uint16_t index = features[i].first;
+        int32_t coefficient = 0;
+
+        for (; i < features.size() && features[i].first == index; i++) {
+            coefficient += features[i].second;
+        }
+
+        if (coefficient != 0) {
+            chunk.feature_indices.push_back(index);
+            chunk.feature_coefficients.push_back(coefficient);
+        }
     }
 
-    return alpha;
+    chunk.feature_starts.push_back(chunk.feature_indices.size());
+}
+
+inline double material_scale(uint16_t index, double phase) {
+    return index >= TUNE_MATERIAL_OFFSET && index < TUNE_MOBILITY_OFFSET ? 1 + phase / 2 : 1;
 }
 
-void iterative_deepening() {
-    search_start_time = now_ms();
+double tune_evaluate(const tune_chunk& chunk, size_t position, const tune_weights& weights) {
+    double phase = chunk.phases[position];
+    double score = chunk.bases[position];
+
+    for (uint32_t i = chunk.feature_starts[position]; i < chunk.feature_starts[position + 1]; i++) {
+        uint16_t index = chunk.feature_indices[i];
+        score += chunk.feature_coefficients[i] * ((1 - phase) * weights[index][MIDGAME] + phase * weights[index][ENDGAME]) * material_scale(index, phase);
+    }
 
-    stop = false;
+    return score;
+}
 
-    nodes = 0;
-    
-    int8_t depth = STARTING_DEPTH;
-    chess::Move bestmove = chess::Move::NO_MOVE;
+inline double win_probability(double score, double k) {
+    return 1 / (1 + std::exp(-k * score * std::numbers::ln10 / 400));
+}
 
-    position_table.clear();
+// Runs fn(index, chunk) on one thread per chunk and sums what they return
+template <typename F>
+double for_each_chunk(std::vector<tune_chunk>& chunks, F fn) {
+    std::vector<double> sums(chunks.size(), 0);
+    std::vector<std::thread> threads;
 
-    for (int i = 0; i < MAX_DEPTH; i++) {
-        killer_moves[i] = std::deque<chess::Move>();
+    for (size_t i = 0; i < chunks.size(); i++) {
+        threads.emplace_back([&, i]() {
+            sums[i] = fn(i, chunks[i]);
+        });
     }
 
-    memset(&countermove_table, 0, sizeof(countermove_table));
-    memset(&history_table, 0, sizeof(history_table));
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
 
-    int32_t gamma = score_board(board);
+    double sum = 0;
 
-    std::vector<chess::Move> move_stack;
+    for (double value : sums) {
+        sum += value;
+    }
 
-    while (!stop_search() && depth < MAX_DEPTH) {
-        seldepth = 0;
-        int32_t aspw_lower = -ASPIRATION_WINDOW_DEFAULT;
-        int32_t aspw_higher = ASPIRATION_WINDOW_DEFAULT;
-        int32_t score = 0;
+    return sum;
+}
 
-        if (depth >= ASPIRATION_WINDOW_DEPTH) {
-            while (true) {
-                int32_t alpha = gamma + aspw_lower;
-                int32_t beta = gamma + aspw_higher;
-                score = alpha_beta(board, move_stack, depth, 0, alpha, beta);
+void write_eval_weights(const std::string& path, const tune_weights& weights) {
+    auto weight = [&](uint16_t index, uint8_t phase) {
+        return (int32_t)std::clamp(std::round(weights[index][phase]), (double)INT16_MIN, (double)INT16_MAX);
+    };
 
-                if (score == SCORE_NONE) {
-                    break;
-                }
+    auto write_scalar = [&](std::ofstream& output, const char* name, uint16_t index) {
+        output << std::format("static const int16_t {}[2] = {{{}, {}}};", name, weight(index, MIDGAME), weight(index, ENDGAME)) << std::endl;
+    };
 
-                gamma = score;
+    auto write_tables = [&](std::ofstream& output, const char* name, uint16_t offset, uint8_t size) {
+        output << std::format("static const int16_t {}[6][2][{}] = {{", name, size) << std::endl;
 
-                if (score <= alpha) {
-                    aspw_lower *= ASPIRATION_INCREASE_EXPONENT;
-                }
-                else if (score >= beta) {
-                    aspw_higher *= ASPIRATION_INCREASE_EXPONENT;
-                }
-                else {
-                    break;
+        for (uint8_t type = 0; type < 6; type++) {
+            output << "    { // " << PIECE_TYPE_NAMES[type] << std::endl;
+
+            for (uint8_t phase = 0; phase < N_PHASES; phase++) {
+                output << "        {";
+
+                for (uint8_t i = 0; i < size; i++) {
+                    output << (i ? ", " : "") << weight(offset + type * size + i, phase);
                 }
+
+                output << (phase == MIDGAME ? "}," : "}") << std::endl;
             }
+
+            output << (type < 5 ? "    }," : "    }") << std::endl;
         }
-        else {
-            score = alpha_beta(board, move_stack, depth, 0, -CHECKMATE_SCORE, CHECKMATE_SCORE);
-            gamma = score;
+
+        output << "};" << std::endl;
+    };
+
+    std::ofstream output(path);
+
+    output << "#pragma once" << std::endl << std::endl;
+    output << "#include <cstdint>" << std::endl << std::endl;
+    output << "// Evaluation weights as {midgame, endgame} pairs, written by ./qchess tune" << std::endl << std::endl;
+
+    output << "static const int16_t PHASED_CP_PIECE_VALUES[2][7] = {" << std::endl;
+
+    for (uint8_t phase = 0; phase < N_PHASES; phase++) {
+        output << "    {";
+
+        for (uint8_t type = 0; type < 5; type++) {
+            output << weight(TUNE_MATERIAL_OFFSET + type, phase) << ", ";
         }
 
-        if (score != SCORE_NONE) {
-            chess::Movelist pv_line;
-            generate_pv_line(pv_line, board);
+        output << (phase == MIDGAME ? "0, 0}, // midgame" : "0, 0} // endgame") << std::endl;
+    }
+
+    output << "};" << std::endl << std::endl;
 
-            std::string depth_string = std::format(" depth {} seldepth {}", depth, seldepth);
-            std::string time_string = std::format(" time {}", now_ms()-search_start_time);
-            std::string hashfull_string = std::format(" hashfull {}", (position_table.size() * 1000 / MAX_PTABLE_SIZE));
-            std::string pv_string = " ";
-            for (chess::Move move : pv_line) {
-                pv_string += chess::uci::moveToUci(move) + " ";
-            }
-            uint32_t nodes_per_second = nodes * 1000 / (std::max(now_ms()-search_start_time, (int64_t)1));
+    write_scalar(output, "DOUBLED_PAWN_PENALTY", TUNE_DOUBLED_PAWN);
+    write_scalar(output, "TRIPLED_PAWN_PENALTY", TUNE_TRIPLED_PAWN);
+    write_scalar(output, "ISOLATED_PAWN_PENALTY", TUNE_ISOLATED_PAWN);
+    write_scalar(output, "PASSED_PAWN_BONUS", TUNE_PASSED_PAWN);
+    write_scalar(output, "DOUBLE_BISHOP_BONUS", TUNE_DOUBLE_BISHOP);
+    write_scalar(output, "OPEN_FILE_NEAR_KING_PENALTY", TUNE_OPEN_FILE_NEAR_KING);
+    write_scalar(output, "TEMPO_BONUS", TUNE_TEMPO);
+    output << std::endl;
+
+    write_tables(output, "PIECE_POSITION_TABLES", TUNE_POSITION_OFFSET, 64);
+    output << std::endl;
+    write_tables(output, "PIECE_MOBILITY_TABLES", TUNE_MOBILITY_OFFSET, 28);
+}
+
+// Texel tuning of the hand crafted eval on datagen records. Fits the sigmoid scale K to
+// the current weights, then runs full batch Adam on the mean squared error between the
+// predicted and target win probability, writing the weights out as it goes.
+void tune(const std::string& input_path, const std::string& output_path, int32_t epochs, int32_t thread_count, double lambda, double learning_rate) {
+    int64_t start_time = now_ms();
+
+    std::ifstream input(input_path, std::ios::binary | std::ios::ate);
+
+    if (!input) {
+        std::cerr << "failed to open " << input_path << std::endl;
+        return;
+    }
+
+    std::vector<datagen_record> records(input.tellg() / sizeof(datagen_record));
+    input.seekg(0);
+    input.read((char*)records.data(), records.size() * sizeof(datagen_record));
+
+    if (records.empty()) {
+        std::cerr << "no positions in " << input_path << std::endl;
+        return;
+    }
+
+    thread_count = std::clamp(thread_count, 1, MAX_THREADS);
+
+    std::vector<tune_chunk> chunks(thread_count);
+
+    for_each_chunk(chunks, [&](size_t id, tune_chunk& chunk) {
+        size_t begin = records.size() * id / chunks.size();
+        size_t end = records.size() * (id + 1) / chunks.size();
 
-            bestmove = pv_line.size() ? pv_line[0] : chess::Move::NO_MOVE;
+        for (size_t i = begin; i < end; i++) {
+            collect_eval_features(chess::Board::Compact::decode(records[i].board), chunk);
+            chunk.targets.push_back(records[i].result / 2.0);
+            chunk.scores.push_back(records[i].score);
+        }
+
+        return 0.0;
+    });
+
+    records = std::vector<datagen_record>();
 
-            std::cout << "info nodes " << nodes << " nps " << nodes_per_second << time_string << hashfull_string << depth_string << " score ";
+    tune_weights weights = {};
 
-            if (IS_MATE_SCORE(score)) {
-                int8_t mate_in = std::ceil((float)pv_line.size() / 2.0f) * COLOR_MOD[score < 0];
-                std::cout << "mate " << (int)mate_in << " pv" << pv_string << std::endl;
+    for (uint8_t phase = 0; phase < N_PHASES; phase++) {
+        for (uint8_t type = 0; type < 6; type++) {
+            for (uint8_t i = 0; i < 64; i++) {
+                weights[TUNE_POSITION_OFFSET + type * 64 + i][phase] = PIECE_POSITION_TABLES[type][phase][i];
             }
-            else {
-                std::cout << "cp " << score << " pv" << pv_string << std::endl;
+
+            for (uint8_t i = 0; i < 28; i++) {
+                weights[TUNE_MOBILITY_OFFSET + type * 28 + i][phase] = PIECE_MOBILITY_TABLES[type][phase][i];
+            }
+
+            if (type < 5) {
+                weights[TUNE_MATERIAL_OFFSET + type][phase] = PHASED_CP_PIECE_VALUES[phase][type];
             }
         }
 
-        depth += 1;
+        weights[TUNE_DOUBLED_PAWN][phase] = DOUBLED_PAWN_PENALTY[phase];
+        weights[TUNE_TRIPLED_PAWN][phase] = TRIPLED_PAWN_PENALTY[phase];
+        weights[TUNE_ISOLATED_PAWN][phase] = ISOLATED_PAWN_PENALTY[phase];
+        weights[TUNE_PASSED_PAWN][phase] = PASSED_PAWN_BONUS[phase];
+        weights[TUNE_DOUBLE_BISHOP][phase] = DOUBLE_BISHOP_BONUS[phase];
+        weights[TUNE_OPEN_FILE_NEAR_KING][phase] = OPEN_FILE_NEAR_KING_PENALTY[phase];
+        weights[TUNE_TEMPO][phase] = TEMPO_BONUS[phase];
     }
 
-    if (bestmove == chess::Move::NO_MOVE) {
-        chess::Movelist moves;
-        chess::movegen::legalmoves(moves, board);
-        sort_moves(moves, board, move_stack, 0);
-        bestmove = moves[0];
+    uint64_t position_count = 0;
+
+    for (const tune_chunk& chunk : chunks) {
+        position_count += chunk.size();
     }
 
-    std::cout << "bestmove " << chess::uci::moveToUci(bestmove) << std::endl;
-    stop = true;
-}
+    auto result_error = [&](double k) {
+        return for_each_chunk(chunks, [&](size_t, tune_chunk& chunk) {
+            double error = 0;
 
+            for (size_t i = 0; i < chunk.size(); i++) {
+                double difference = chunk.targets[i] - win_probability(tune_evaluate(chunk, i, weights), k);
+                error += difference * difference;
+            }
 
-int main() {
-    generate_passing_fields();
+            return error;
+        }) / position_count;
+    };
 
-    while (true) {
-        std::thread* search_thread = nullptr;
-        std::string cmd;
-        std::cin >> cmd;
-
-        if (cmd == "uci") {
-            std::cout << std::format("id name {}", VERSION) << std::endl;
-            std::cout << std::format("id author {}", AUTHOR) << std::endl;
-            std::cout << "uciok" << std::endl;
-        }
-        else if (cmd == "isready") {
-            std::cout << "readyok" << std::endl;
-        }
-        else if (cmd == "quit") {
-            if (!stop) {
-                stop = true;
-                if (search_thread != nullptr) {
-                    search_thread->join();
-                    delete search_thread;
-                }
-            }
-            break;
+    // Ternary search, the error is unimodal in K
+    double k_low = TUNE_K_MIN;
+    double k_high = TUNE_K_MAX;
+
+    for (int32_t i = 0; i < TUNE_K_ITERATIONS; i++) {
+        double k1 = k_low + (k_high - k_low) / 3;
+        double k2 = k_high - (k_high - k_low) / 3;
+
+        if (result_error(k1) < result_error(k2)) {
+            k_high = k2;
         }
-        else if (cmd == "go") {
-            std::string args;
-            std::getline(std::cin, args);
-            std::istringstream args_stream(args);
-            
-            std::string subcmd;
+        else {
+            k_low = k1;
+        }
+    }
 
-            movetime = 0;
-            wtime = 0;
-            btime = 0;
-            winc = 0;
-            binc = 0;
+    double k = (k_low + k_high) / 2;
 
-            while(args_stream >> subcmd) {
-                if (subcmd == "movetime") {
-                    args_stream >> movetime;
-                }
-                else if (subcmd == "wtime") {
-                    args_stream >> wtime;
-                }
-                else if (subcmd == "btime") {
-                    args_stream >> btime;
-                }
-                else if (subcmd == "winc") {
-                    args_stream >> winc;
-                }
-                else if (subcmd == "binc") {
-                    args_stream >> binc;
+    // Blend the game result with the search score as the training target
+    for (tune_chunk& chunk : chunks) {
+        for (size_t i = 0; i < chunk.size(); i++) {
+            chunk.targets[i] = lambda * chunk.targets[i] + (1 - lambda) * win_probability(chunk.scores[i], k);
+        }
+    }
+
+    std::cerr << std::format("positions {} K {:.4f} loss {:.6f} load time {} ms", position_count, k, result_error(k), now_ms() - start_time) << std::endl;
+
+    std::vector<tune_weights> gradients(chunks.size());
+    tune_weights gradient;
+    tune_weights momentum = {};
+    tune_weights velocity = {};
+
+    for (int32_t epoch = 1; epoch <= epochs; epoch++) {
+        double loss = for_each_chunk(chunks, [&](size_t id, tune_chunk& chunk) {
+            tune_weights& chunk_gradient = gradients[id];
+            chunk_gradient = {};
+
+            double error = 0;
+
+            for (size_t position = 0; position < chunk.size(); position++) {
+                double phase = chunk.phases[position];
+                double probability = win_probability(tune_evaluate(chunk, position, weights), k);
+                double difference = probability - chunk.targets[position];
+                double slope = 2 * difference * probability * (1 - probability) * k * std::numbers::ln10 / 400;
+
+                error += difference * difference;
+
+                for (uint32_t i = chunk.feature_starts[position]; i < chunk.feature_starts[position + 1]; i++) {
+                    uint16_t index = chunk.feature_indices[i];
+                    double scaled = slope * chunk.feature_coefficients[i] * material_scale(index, phase);
+
+                    chunk_gradient[index][MIDGAME] += scaled * (1 - phase);
+                    chunk_gradient[index][ENDGAME] += scaled * phase;
                 }
             }
 
-            if (board.sideToMove() == chess::Color::WHITE && wtime != 0) {
-                movetime = std::max(std::min(wtime / 40 + winc-50, std::max(wtime / 2 - 1000, 0)), 50);
-            } else if (btime != 0) {
-                movetime = std::max(std::min(btime / 40 + binc-50, std::max(btime / 2 - 1000, 0)), 50);
-            }
-        
-            if (stop) {
-                search_thread = new std::thread(iterative_deepening);
+            return error;
+        }) / position_count;
+
+        gradient = {};
+
+        for (const tune_weights& chunk_gradient : gradients) {
+            for (uint16_t index = 0; index < TUNE_PARAMS; index++) {
+                for (uint8_t phase = 0; phase < N_PHASES; phase++) {
+                    gradient[index][phase] += chunk_gradient[index][phase] / position_count;
+                }
             }
         }
-        else if (cmd == "stop") {
-            if (!stop) {
-                stop = true;
-                if (search_thread != nullptr) {
-                    search_thread->join();
-                    delete search_thread;
-                }
+
+        double momentum_correction = 1 - std::pow(ADAM_BETA1, epoch);
+        double velocity_correction = 1 - std::pow(ADAM_BETA2, epoch);
+
+        for (uint16_t index = 0; index < TUNE_PARAMS; index++) {
+            for (uint8_t phase = 0; phase < N_PHASES; phase++) {
+                momentum[index][phase] = ADAM_BETA1 * momentum[index][phase] + (1 - ADAM_BETA1) * gradient[index][phase];
+                velocity[index][phase] = ADAM_BETA2 * velocity[index][phase] + (1 - ADAM_BETA2) * gradient[index][phase] * gradient[index][phase];
+
+                weights[index][phase] -= learning_rate * (momentum[index][phase] / momentum_correction) / (std::sqrt(velocity[index][phase] / velocity_correction) + ADAM_EPSILON);
             }
         }
-        else if (cmd == "position") {
-            if (stop) {
-                std::string args;
-                std::getline(std::cin, args);
-                std::istringstream args_stream(args);
 
-                std::string subcmd;
-                std::string arg;
+        if (epoch % TUNE_REPORT_INTERVAL == 0 || epoch == epochs) {
+            std::cerr << std::format("epoch {} loss {:.6f} time {} ms", epoch, loss, now_ms() - start_time) << std::endl;
+        }
+
+        if (epoch % TUNE_SAVE_INTERVAL == 0) {
+            write_eval_weights(output_path, weights);
+        }
+    }
 
-                if (args_stream >> subcmd) {
-                    if (subcmd == "startpos") {
-                        board = chess::Board(chess::constants::STARTPOS);
+    write_eval_weights(output_path, weights);
+}
 
-                        if (!(args_stream >> arg)) {
-                            continue;
-                        }
-                    }
-                    else if (subcmd == "fen") {
-                        std::string fen = "";
-
-                        while (args_stream >> arg) {
-                            if (arg == "moves") {
-                                break;
-                            }
-                            fen += arg;
-                            fen += " ";
-                        }
-
-                        board = chess::Board::fromFen(fen);
-                    }
+// Direct mapped, always replace table of subtree sizes. A slot holds the node count
+// shifted over the depth as data and the hash xored with it, like the position table.
+struct perft_table {
+    position_table_slot* slots = nullptr;
+    uint64_t mask = 0;
 
-                    if (arg == "moves") {
-                        while (args_stream >> arg) {
-                            board.makeMove(chess::uci::uciToMove(board, arg));
-                        }
-                    }
-                }
-            }
+    perft_table(size_t megabytes) {
+        size_t slot_count = 1;
+        while (slot_count * 2 * sizeof(position_table_slot) <= megabytes * 1024 * 1024) {
+            slot_count *= 2;
+        }
+
+        slots = (position_table_slot*)allocate_table_memory(slot_count * sizeof(position_table_slot));
+
+        if (slots == nullptr) {
+            std::cerr << "failed to allocate " << megabytes << "MB perft table" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        memset(slots, 0, slot_count * sizeof(position_table_slot));
+        mask = slot_count - 1;
+    }
+
+    perft_table(const perft_table&) = delete;
+    perft_table& operator=(const perft_table&) = delete;
+
+    ~perft_table() {
+        free_table_memory(slots);
+    }
+
+    bool probe(uint64_t hash, int8_t depth, uint64_t& nodes) const {
+        const position_table_slot& slot = slots[hash & mask];
+        uint64_t data = transposition_table::load_word(slot.data);
+
+        if ((uint8_t)data == depth && (transposition_table::load_word(slot.key) ^ data) == hash) {
+            nodes = data >> 8;
+            return true;
+        }
+
+        return false;
+    }
+
+    void store(uint64_t hash, int8_t depth, uint64_t nodes) {
+        position_table_slot& slot = slots[hash & mask];
+        uint64_t data = (nodes << 8) | (uint8_t)depth;
+
+        transposition_table::store_word(slot.key, hash ^ data);
+        transposition_table::store_word(slot.data, data);
+    }
+};
+
+uint64_t perft(chess::Board& board, int8_t depth, perft_table& table) {
+    chess::Movelist moves;
+    chess::movegen::legalmoves(moves, board);
+
+    // Bulk counting, the last ply is never made
+    if (depth <= 1) {
+        return depth == 1 ? moves.size() : 1;
+    }
+
+    uint64_t hash = board.hash();
+    uint64_t nodes = 0;
+
+    if (table.probe(hash, depth, nodes)) {
+        return nodes;
+    }
+
+    for (chess::Move move : moves) {
+        board.makeMove(move);
+        nodes += perft(board, depth - 1, table);
+        board.unmakeMove(move);
+    }
+
+    table.store(hash, depth, nodes);
+
+    return nodes;
+}
+
+// Splits the root moves over the search threads, which share one perft table, and
+// prints the subtree size of every root move before the total.
+uint64_t perft_divide(const chess::Board& root, int8_t depth, size_t thread_count) {
+    int64_t start_time = now_ms();
+
+    chess::Movelist moves;
+    chess::movegen::legalmoves(moves, root);
+
+    // Depth zero counts the root itself, a mated or stalemated root has nothing to divide
+    if (depth <= 0 || moves.empty()) {
+        uint64_t nodes = depth <= 0 ? 1 : 0;
+        std::cout << "Nodes searched: " << nodes << std::endl;
+        return nodes;
+    }
+
+    std::vector<uint64_t> move_nodes(moves.size(), 0);
+    std::atomic<size_t> next_move = 0;
+    perft_table table(PERFT_TABLE_SIZE_MB);
+
+    auto perft_worker = [&]() {
+        chess::Board board = root;
+        size_t i;
+
+        while ((i = next_move.fetch_add(1)) < (size_t)moves.size()) {
+            board.makeMove(moves[i]);
+            move_nodes[i] = perft(board, depth - 1, table);
+            board.unmakeMove(moves[i]);
         }
+    };
+
+    std::vector<std::thread> threads;
+
+    for (size_t i = 1; i < std::clamp(thread_count, (size_t)1, (size_t)moves.size()); i++) {
+        threads.emplace_back(perft_worker);
+    }
+
+    perft_worker();
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    uint64_t nodes = 0;
+
+    for (int i = 0; i < moves.size(); i++) {
+        std::cout << chess::uci::moveToUci(moves[i]) << ": " << move_nodes[i] << std::endl;
+        nodes += move_nodes[i];
     }
-    return 0;
+
+    int64_t elapsed = std::max(now_ms() - start_time, (int64_t)1);
+
+    std::cout << std::endl;
+    std::cout << "Nodes searched: " << nodes << std::endl;
+    std::cout << "Time (ms)     : " << elapsed << std::endl;
+    std::cout << "Nodes/second  : " << nodes * 1000 / elapsed << std::endl;
+
+    return nodes;
 }
@@ -0,0 +1,208 @@
+#pragma once
+
+// There is no build system, the engine is a single translation unit plus the UCI front end:
+//   g++ -std=c++20 -O2 -pthread qchess.cpp uci.cpp -o qchess
+// Add -march=native (or -mavx2 / -msse4.1) for the SIMD NNUE kernels. To embed the engine,
+// include this header and compile qchess.cpp with your own sources instead of uci.cpp.
+
+#include "chess.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define VERSION "QChess v3.0"
+#define AUTHOR "qwertyquerty"
+
+#define PTABLE_SIZE_MB 64
+#define PTABLE_MIN_SIZE_MB 1
+#define PTABLE_MAX_SIZE_MB 65536
+
+#define DEFAULT_THREADS 1
+#define MAX_THREADS 256
+
+#define DEFAULT_MULTIPV 1
+#define MAX_MULTIPV 256
+
+#define DEFAULT_MOVE_OVERHEAD 30
+#define MAX_MOVE_OVERHEAD 5000
+
+#define BENCH_DEPTH 8
+#define BENCH_THREADS 1
+#define BENCH_HASH_MB 16
+#define BENCH_STOP_MOVETIME 100
+
+#define BATCH_DEPTH 10
+#define BATCH_HASH_MB 16
+
+#define DATAGEN_NODES 5000
+#define DATAGEN_POSITIONS 10000000
+#define DATAGEN_HASH_MB 16
+
+#define TUNE_EPOCHS 1000
+#define TUNE_LAMBDA 1.0
+#define TUNE_LEARNING_RATE 1.0
+
+// Zero means no limit
+struct search_limits {
+    int32_t movetime = 0;
+    int32_t wtime = 0;
+    int32_t btime = 0;
+    int32_t winc = 0;
+    int32_t binc = 0;
+    int32_t movestogo = 0;
+    int32_t depth = 0;
+    int32_t mate = 0; // stop once a mate in this many moves is found
+    uint64_t nodes = 0;
+    bool infinite = false; // ignore the clock and only return once stopped
+    bool ponder = false; // ignore the clock until ponderhit, then search as a timed move
+    std::vector<chess::Move> searchmoves; // only search these root moves, all if empty
+};
+
+// Reported by the main search thread after every completed iteration
+struct search_info {
+    int32_t multipv = 1; // rank of the line among the MultiPV lines, best first
+    int32_t depth = 0;
+    int32_t seldepth = 0;
+    int32_t score = 0;
+    int32_t mate = 0; // moves to mate, negative when getting mated, zero if no mate was found
+    uint64_t nodes = 0;
+    uint64_t nps = 0;
+    int64_t time = 0;
+    uint16_t hashfull = 0;
+    std::vector<chess::Move> pv;
+};
+
+struct search_result {
+    chess::Move best_move = chess::Move::NO_MOVE; // NO_MOVE when the root has no legal moves
+    int32_t score = 0;
+    int32_t mate = 0;
+    int32_t depth = 0;
+    uint64_t nodes = 0;
+    int64_t time = 0;
+    std::vector<chess::Move> pv;
+    std::vector<search_info> lines; // every MultiPV line of the last completed depth
+    uint64_t pawn_table_probes = 0;
+    uint64_t pawn_table_hits = 0;
+};
+
+// Copies share one flag, cancelling any of them stops the analysis it was handed to
+struct cancellation_token {
+    std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+
+    void cancel() const {
+        flag->store(true, std::memory_order_relaxed);
+    }
+
+    bool cancelled() const {
+        return flag->load(std::memory_order_relaxed);
+    }
+};
+
+typedef std::function<void(const search_info&)> search_info_callback;
+
+struct transposition_table;
+struct search_context;
+
+// Position table of the given size, to pass to several engines so they share it. Null if
+// the memory can't be allocated.
+std::shared_ptr<transposition_table> make_shared_table(size_t megabytes = PTABLE_SIZE_MB);
+
+// Outcome of an engine setter that can fail
+enum class setting_result {
+    APPLIED,
+    BUSY, // an analysis is running, nothing changed
+    FAILED // the new setting couldn't be applied, the old one is kept
+};
+
+// Embeddable engine. Each instance runs one analysis at a time on its own threads and
+// heuristics, with a private position table or one shared between engines. Throws
+// std::bad_alloc if not even the smallest private table can be allocated.
+struct engine {
+    engine(size_t hash_mb = PTABLE_SIZE_MB, int32_t thread_count = DEFAULT_THREADS);
+    engine(std::shared_ptr<transposition_table> shared_table, int32_t thread_count = DEFAULT_THREADS);
+    ~engine();
+
+    engine(const engine&) = delete;
+    engine& operator=(const engine&) = delete;
+
+    // Starts searching board in the background, waiting for a previous analysis to
+    // finish first. on_info is called from the search thread after every depth.
+    std::future<search_result> analyse(const chess::Board& board, const search_limits& limits, search_info_callback on_info = nullptr, cancellation_token token = cancellation_token());
+
+    void stop();
+    // Turns a ponder search into a timed one, with the clock starting now
+    void ponderhit();
+    void wait();
+    bool searching() const;
+
+    // Ignored while an analysis is running, after stop() they first wait for the search
+    // thread to finish. This only covers this engine, so with a shared table the caller
+    // must make sure no other sharer is searching either.
+    setting_result set_hash_size(size_t megabytes);
+    void clear_hash();
+    void set_thread_count(int32_t thread_count);
+    size_t thread_count() const;
+
+    // Number of best root moves searched and reported, each with its own line
+    void set_multipv(int32_t multipv);
+
+    // Milliseconds kept back from every time budget for communication delays
+    void set_move_overhead(int32_t move_overhead);
+
+    // Loads an NNUE network file, keeping the current network if it can't be read (FAILED)
+    // or an analysis is running (BUSY).
+    // NNUE is enabled by default, so loading a network is enough to switch to it.
+    // Without a network the hand crafted eval is used even if NNUE is enabled.
+    setting_result load_network(const std::string& path);
+    void set_use_nnue(bool use_nnue);
+    bool using_nnue() const;
+
+private:
+    bool idle();
+
+    std::unique_ptr<search_context> context;
+    std::thread search_thread;
+};
+
+// Searches the embedded bench suite and prints the node signature
+void bench(int32_t depth, int32_t thread_count, size_t hash_mb);
+
+enum class batch_format {
+    JSONL,
+    CSV
+};
+
+// Searches every FEN or EPD line of input with a pool of single threaded searches and
+// writes one record per position, or an error record for a line that isn't a legal
+// position. Returns the number of positions analysed.
+uint64_t analyse_batch(std::istream& input, std::ostream& output, const search_limits& limits, batch_format format, int32_t thread_count, size_t hash_mb);
+
+#define DATAGEN_BLACK_WIN 0
+#define DATAGEN_DRAW 1
+#define DATAGEN_WHITE_WIN 2
+
+// Self-play training position as stored on disk, 28 bytes
+struct datagen_record {
+    chess::PackedBoard board;
+    int16_t score; // centipawns from white's point of view
+    uint8_t result; // DATAGEN_BLACK_WIN, DATAGEN_DRAW or DATAGEN_WHITE_WIN
+    uint8_t padding;
+};
+
+static_assert(sizeof(datagen_record) == 28, "datagen records must stay 28 bytes");
+
+// Plays fixed node self-play games on thread_count threads until target_positions records
+// are written to path, reporting throughput to stderr. Returns the number of records.
+uint64_t datagen(const std::string& path, int32_t thread_count, uint64_t nodes, uint64_t target_positions, uint64_t seed, size_t hash_mb);
+
+// Fits the eval weights to the game results of datagen records, blended with their search
+// scores by 1 - lambda, and writes them to output_path in the eval_weights.hpp format
+void tune(const std::string& input_path, const std::string& output_path, int32_t epochs, int32_t thread_count, double lambda, double learning_rate);
+
+// Prints the perft count of every root move and the total
+uint64_t perft_divide(const chess::Board& root, int8_t depth, size_t thread_count);
@@ -0,0 +1,539 @@
+#include "qchess.hpp"
+#include <string>
+#include <format>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <random>
+#include <charconv>
+#include <cmath>
+
+// Parses a whole option value as an integer, false if it is empty or not a number
+bool parse_integer(const std::string& text, int64_t& value) {
+    const char* end = text.data() + text.size();
+    auto [parsed_end, error] = std::from_chars(text.data(), end, value);
+
+    return !text.empty() && error == std::errc() && parsed_end == end;
+}
+
+// Parses a command line argument as an integer in [min, max], printing a usage error otherwise
+bool parse_argument(const std::string& name, const std::string& text, int64_t min, int64_t max, int64_t& value) {
+    if (parse_integer(text, value) && value >= min && value <= max) {
+        return true;
+    }
+
+    std::cerr << std::format("invalid {} {}, expected an integer from {} to {}", name, text, min, max) << std::endl;
+    return false;
+}
+
+// Same for a decimal argument in [min, max]
+bool parse_decimal_argument(const std::string& name, const std::string& text, double min, double max, double& value) {
+    const char* end = text.data() + text.size();
+    auto [parsed_end, error] = std::from_chars(text.data(), end, value);
+
+    if (!text.empty() && error == std::errc() && parsed_end == end && value >= min && value <= max) {
+        return true;
+    }
+
+    std::cerr << std::format("invalid {} {}, expected a number from {} to {}", name, text, min, max) << std::endl;
+    return false;
+}
+
+void print_info(const search_info& info) {
+    std::string pv_string = " ";
+    for (chess::Move move : info.pv) {
+        pv_string += chess::uci::moveToUci(move) + " ";
+    }
+
+    std::cout << std::format("info nodes {} nps {} time {} hashfull {} depth {} seldepth {} multipv {} score ", info.nodes, info.nps, info.time, info.hashfull, info.depth, info.seldepth, info.multipv);
+
+    if (info.mate != 0) {
+        std::cout << "mate " << info.mate << " pv" << pv_string << std::endl;
+    }
+    else {
+        std::cout << "cp " << info.score << " pv" << pv_string << std::endl;
+    }
+}
+
+void print_bestmove(std::future<search_result> future) {
+    search_result result = future.get();
+
+    std::cout << std::format("info string pawn table hits {} probes {} hitrate {}%", result.pawn_table_hits, result.pawn_table_probes, result.pawn_table_hits * 100 / std::max(result.pawn_table_probes, (uint64_t)1)) << std::endl;
+    std::cout << "bestmove " << (result.best_move == chess::Move::NO_MOVE ? "0000" : chess::uci::moveToUci(result.best_move));
+
+    // The expected reply, which the GUI sends back as the position to ponder on
+    if (result.pv.size() >= 2) {
+        std::cout << " ponder " << chess::uci::moveToUci(result.pv[1]);
+    }
+
+    std::cout << std::endl;
+}
+
+// UCI front end, a thin client of the engine API
+int main(int argc, char* argv[]) {
+    // ./qchess bench [depth] [threads] [hash]
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        int64_t depth = BENCH_DEPTH;
+        int64_t thread_count = BENCH_THREADS;
+        int64_t hash_mb = BENCH_HASH_MB;
+
+        if (
+            (argc > 2 && !parse_argument("depth", argv[2], 1, INT32_MAX, depth)) ||
+            (argc > 3 && !parse_argument("threads", argv[3], 1, MAX_THREADS, thread_count)) ||
+            (argc > 4 && !parse_argument("hash", argv[4], PTABLE_MIN_SIZE_MB, PTABLE_MAX_SIZE_MB, hash_mb))
+        ) {
+            return 1;
+        }
+
+        bench(depth, thread_count, hash_mb);
+
+        return 0;
+    }
+
+    // ./qchess perft <depth> [threads] [fen]
+    if (argc > 2 && std::string(argv[1]) == "perft") {
+        int64_t depth;
+        int64_t thread_count = std::thread::hardware_concurrency();
+
+        if (
+            !parse_argument("depth", argv[2], 1, INT8_MAX, depth) ||
+            (argc > 3 && !parse_argument("threads", argv[3], 1, MAX_THREADS, thread_count))
+        ) {
+            return 1;
+        }
+
+        std::string fen;
+
+        for (int i = 4; i < argc; i++) {
+            fen += std::string(argv[i]) + " ";
+        }
+
+        perft_divide(
+            fen.empty() ? chess::Board(chess::constants::STARTPOS) : chess::Board::fromFen(fen),
+            depth,
+            thread_count
+        );
+
+        return 0;
+    }
+
+    // ./qchess analyse-batch [input <file>] [output <file>] [depth <n>] [nodes <n>] [threads <n>] [hash <mb>] [format jsonl|csv]
+    if (argc > 1 && std::string(argv[1]) == "analyse-batch") {
+        search_limits limits;
+        batch_format format = batch_format::JSONL;
+        int32_t thread_count = std::thread::hardware_concurrency();
+        size_t hash_mb = BATCH_HASH_MB;
+        std::ifstream input_file;
+        std::ofstream output_file;
+
+        for (int i = 2; i + 1 < argc; i += 2) {
+            std::string name = argv[i];
+            std::string value = argv[i + 1];
+
+            if (name == "input") {
+                input_file.open(value);
+
+                if (!input_file.is_open()) {
+                    std::cerr << "failed to open " << value << std::endl;
+                    return 1;
+                }
+            }
+            else if (name == "output") {
+                output_file.open(value);
+
+                if (!output_file.is_open()) {
+                    std::cerr << "failed to open " << value << std::endl;
+                    return 1;
+                }
+            }
+            else if (name == "depth" || name == "nodes" || name == "threads" || name == "hash") {
+                int64_t number;
+
+                if (name == "depth" && parse_argument(name, value, 1, INT32_MAX, number)) {
+                    limits.depth = number;
+                }
+                else if (name == "nodes" && parse_argument(name, value, 1, INT64_MAX, number)) {
+                    limits.nodes = number;
+                }
+                else if (name == "threads" && parse_argument(name, value, 1, MAX_THREADS, number)) {
+                    thread_count = number;
+                }
+                else if (name == "hash" && parse_argument(name, value, PTABLE_MIN_SIZE_MB, PTABLE_MAX_SIZE_MB, number)) {
+                    hash_mb = number;
+                }
+                else {
+                    return 1;
+                }
+            }
+            else if (name == "format") {
+                format = value == "csv" ? batch_format::CSV : batch_format::JSONL;
+            }
+        }
+
+        if (!limits.depth && !limits.nodes) {
+            limits.depth = BATCH_DEPTH;
+        }
+
+        analyse_batch(
+            input_file.is_open() ? input_file : std::cin,
+            output_file.is_open() ? output_file : std::cout,
+            limits,
+            format,
+            thread_count,
+            hash_mb
+        );
+
+        return 0;
+    }
+
+    // ./qchess datagen [output <file>] [threads <n>] [nodes <n>] [positions <n>] [seed <n>] [hash <mb>]
+    if (argc > 1 && std::string(argv[1]) == "datagen") {
+        std::string path = "data.bin";
+        int32_t thread_count = std::thread::hardware_concurrency();
+        uint64_t nodes = DATAGEN_NODES;
+        uint64_t positions = DATAGEN_POSITIONS;
+        uint64_t seed = std::random_device()();
+        size_t hash_mb = DATAGEN_HASH_MB;
+
+        for (int i = 2; i + 1 < argc; i += 2) {
+            std::string name = argv[i];
+            std::string value = argv[i + 1];
+
+            if (name == "output") {
+                path = value;
+            }
+            else if (name == "threads" || name == "nodes" || name == "positions" || name == "seed" || name == "hash") {
+                int64_t number;
+
+                if (name == "threads" && parse_argument(name, value, 1, MAX_THREADS, number)) {
+                    thread_count = number;
+                }
+                else if (name == "nodes" && parse_argument(name, value, 1, INT64_MAX, number)) {
+                    nodes = number;
+                }
+                else if (name == "positions" && parse_argument(name, value, 1, INT64_MAX, number)) {
+                    positions = number;
+                }
+                else if (name == "seed" && parse_argument(name, value, 0, INT64_MAX, number)) {
+                    seed = number;
+                }
+                else if (name == "hash" && parse_argument(name, value, PTABLE_MIN_SIZE_MB, PTABLE_MAX_SIZE_MB, number)) {
+                    hash_mb = number;
+                }
+                else {
+                    return 1;
+                }
+            }
+        }
+
+        datagen(path, thread_count, nodes, positions, seed, hash_mb);
+
+        return 0;
+    }
+
+    // ./qchess tune input <file> [output <file>] [epochs <n>] [threads <n>] [lambda <x>] [lr <x>]
+    if (argc > 1 && std::string(argv[1]) == "tune") {
+        std::string input_path = "data.bin";
+        std::string output_path = "eval_weights.tuned.hpp"; // copy over eval_weights.hpp by hand once checked
+        int32_t epochs = TUNE_EPOCHS;
+        int32_t thread_count = std::thread::hardware_concurrency();
+        double lambda = TUNE_LAMBDA;
+        double learning_rate = TUNE_LEARNING_RATE;
+
+        for (int i = 2; i + 1 < argc; i += 2) {
+            std::string name = argv[i];
+            std::string value = argv[i + 1];
+
+            if (name == "input") {
+                input_path = value;
+            }
+            else if (name == "output") {
+                output_path = value;
+            }
+            else if (name == "epochs" || name == "threads") {
+                int64_t number;
+
+                if (name == "epochs" && parse_argument(name, value, 1, INT32_MAX, number)) {
+                    epochs = number;
+                }
+                else if (name == "threads" && parse_argument(name, value, 1, MAX_THREADS, number)) {
+                    thread_count = number;
+                }
+                else {
+                    return 1;
+                }
+            }
+            else if (name == "lambda" && !parse_decimal_argument(name, value, 0, 1, lambda)) {
+                return 1;
+            }
+            else if (name == "lr" && !parse_decimal_argument(name, value, 0, INFINITY, learning_rate)) {
+                return 1;
+            }
+        }
+
+        tune(input_path, output_path, epochs, thread_count, lambda, learning_rate);
+
+        return 0;
+    }
+
+    engine qchess;
+    chess::Board board = chess::Board(chess::constants::STARTPOS);
+
+    // Waits for the running analysis and prints its bestmove
+    std::thread bestmove_thread;
+
+    auto finish_search = [&]() {
+        if (bestmove_thread.joinable()) {
+            bestmove_thread.join();
+        }
+    };
+
+    while (true) {
+        std::string cmd;
+        std::cin >> cmd;
+
+        if (cmd == "uci") {
+            std::cout << std::format("id name {}", VERSION) << std::endl;
+            std::cout << std::format("id author {}", AUTHOR) << std::endl;
+            std::cout << std::format("option name Hash type spin default {} min {} max {}", PTABLE_SIZE_MB, PTABLE_MIN_SIZE_MB, PTABLE_MAX_SIZE_MB) << std::endl;
+            std::cout << "option name Clear Hash type button" << std::endl;
+            std::cout << std::format("option name Threads type spin default {} min 1 max {}", DEFAULT_THREADS, MAX_THREADS) << std::endl;
+            std::cout << "option name Use NNUE type check default true" << std::endl;
+            std::cout << "option name EvalFile type string default <empty>" << std::endl;
+            std::cout << "option name Ponder type check default false" << std::endl;
+            std::cout << std::format("option name MultiPV type spin default {} min 1 max {}", DEFAULT_MULTIPV, MAX_MULTIPV) << std::endl;
+            std::cout << std::format("option name Move Overhead type spin default {} min 0 max {}", DEFAULT_MOVE_OVERHEAD, MAX_MOVE_OVERHEAD) << std::endl;
+            std::cout << "uciok" << std::endl;
+        }
+        else if (cmd == "ucinewgame") {
+            qchess.clear_hash();
+        }
+        else if (cmd == "isready") {
+            std::cout << "readyok" << std::endl;
+        }
+        else if (cmd == "quit") {
+            qchess.stop();
+            finish_search();
+            break;
+        }
+        else if (cmd == "go") {
+            std::string args;
+            std::getline(std::cin, args);
+            std::istringstream args_stream(args);
+
+            std::string subcmd;
+
+            search_limits limits;
+            int32_t perft_depth = 0;
+            bool reading_searchmoves = false; // every word after searchmoves is a move
+
+            while(args_stream >> subcmd) {
+                if (subcmd == "movetime") {
+                    args_stream >> limits.movetime;
+                }
+                else if (subcmd == "wtime") {
+                    args_stream >> limits.wtime;
+                }
+                else if (subcmd == "btime") {
+                    args_stream >> limits.btime;
+                }
+                else if (subcmd == "winc") {
+                    args_stream >> limits.winc;
+                }
+                else if (subcmd == "binc") {
+                    args_stream >> limits.binc;
+                }
+                else if (subcmd == "movestogo") {
+                    args_stream >> limits.movestogo;
+                }
+                else if (subcmd == "mate") {
+                    args_stream >> limits.mate;
+                }
+                else if (subcmd == "infinite") {
+                    limits.infinite = true;
+                }
+                else if (subcmd == "ponder") {
+                    limits.ponder = true;
+                }
+                else if (subcmd == "depth") {
+                    args_stream >> limits.depth;
+                }
+                else if (subcmd == "nodes") {
+                    args_stream >> limits.nodes;
+                }
+                else if (subcmd == "perft") {
+                    args_stream >> perft_depth;
+                }
+                else if (subcmd == "searchmoves") {
+                    reading_searchmoves = true;
+                }
+                else if (reading_searchmoves) {
+                    chess::Movelist legal_moves;
+                    chess::movegen::legalmoves(legal_moves, board);
+                    chess::Move move = chess::uci::uciToMove(board, subcmd);
+
+                    if (std::find(legal_moves.begin(), legal_moves.end(), move) != legal_moves.end()) {
+                        limits.searchmoves.push_back(move);
+                    }
+                }
+            }
+
+            if (qchess.searching()) {
+                continue;
+            }
+
+            finish_search();
+
+            // Perft runs on the calling thread with the search threads' count
+            if (perft_depth != 0) {
+                if (perft_depth > 0 && perft_depth <= INT8_MAX) {
+                    perft_divide(board, perft_depth, qchess.thread_count());
+                }
+                else {
+                    std::cout << "info string invalid perft depth " << perft_depth << std::endl;
+                }
+
+                continue;
+            }
+
+            bestmove_thread = std::thread(print_bestmove, qchess.analyse(board, limits, print_info));
+        }
+        else if (cmd == "bench") {
+            std::string args;
+            std::getline(std::cin, args);
+            std::istringstream args_stream(args);
+
+            int32_t depth = BENCH_DEPTH;
+            int32_t thread_count = BENCH_THREADS;
+            size_t hash_mb = BENCH_HASH_MB;
+
+            args_stream >> depth >> thread_count >> hash_mb;
+
+            if (!qchess.searching()) {
+                finish_search();
+                bench(depth, thread_count, hash_mb);
+            }
+        }
+        else if (cmd == "ponderhit") {
+            qchess.ponderhit();
+        }
+        else if (cmd == "stop") {
+            qchess.stop();
+            finish_search();
+        }
+        else if (cmd == "setoption") {
+            std::string args;
+            std::getline(std::cin, args);
+            std::istringstream args_stream(args);
+
+            std::string arg;
+            std::string name;
+            std::string value;
+
+            // Option names may contain spaces, so collect everything between name and value
+            args_stream >> arg;
+            while (args_stream >> arg && arg != "value") {
+                name += (name.empty() ? "" : " ") + arg;
+            }
+            // Values may contain spaces too, like file paths
+            std::getline(args_stream >> std::ws, value);
+            value.erase(value.find_last_not_of(" \r\t") + 1);
+
+            int64_t number = 0;
+            bool is_number = parse_integer(value, number);
+
+            if (name == "Hash") {
+                if (is_number) {
+                    int64_t megabytes = std::clamp(number, (int64_t)PTABLE_MIN_SIZE_MB, (int64_t)PTABLE_MAX_SIZE_MB);
+
+                    if (qchess.set_hash_size(megabytes) == setting_result::FAILED) {
+                        std::cout << "info string failed to allocate " << megabytes << "MB hash, keeping the old table" << std::endl;
+                    }
+                }
+                else {
+                    std::cout << "info string invalid Hash value " << value << std::endl;
+                }
+            }
+            else if (name == "Clear Hash") {
+                qchess.clear_hash();
+            }
+            else if (name == "Threads") {
+                if (is_number) {
+                    qchess.set_thread_count(std::clamp(number, (int64_t)1, (int64_t)MAX_THREADS));
+                }
+                else {
+                    std::cout << "info string invalid Threads value " << value << std::endl;
+                }
+            }
+            else if (name == "MultiPV") {
+                if (is_number) {
+                    qchess.set_multipv(std::clamp(number, (int64_t)1, (int64_t)MAX_MULTIPV));
+                }
+                else {
+                    std::cout << "info string invalid MultiPV value " << value << std::endl;
+                }
+            }
+            else if (name == "Move Overhead") {
+                if (is_number) {
+                    qchess.set_move_overhead(std::clamp(number, (int64_t)0, (int64_t)MAX_MOVE_OVERHEAD));
+                }
+                else {
+                    std::cout << "info string invalid Move Overhead value " << value << std::endl;
+                }
+            }
+            else if (name == "Use NNUE") {
+                qchess.set_use_nnue(value == "true");
+            }
+            else if (name == "EvalFile" && value != "<empty>") {
+                setting_result result = qchess.load_network(value);
+
+                if (result == setting_result::FAILED) {
+                    std::cout << "info string failed to load network " << value << std::endl;
+                }
+                else if (result == setting_result::BUSY) {
+                    std::cout << "info string can't load a network while searching" << std::endl;
+                }
+            }
+        }
+        else if (cmd == "position") {
+            if (!qchess.searching()) {
+                std::string args;
+                std::getline(std::cin, args);
+                std::istringstream args_stream(args);
+
+                std::string subcmd;
+                std::string arg;
+
+                if (args_stream >> subcmd) {
+                    if (subcmd == "startpos") {
+                        board = chess::Board(chess::constants::STARTPOS);
+
+                        if (!(args_stream >> arg)) {
+                            continue;
+                        }
+                    }
+                    else if (subcmd == "fen") {
+                        std::string fen = "";
+
+                        while (args_stream >> arg) {
+                            if (arg == "moves") {
+                                break;
+                            }
+                            fen += arg;
+                            fen += " ";
+                        }
+
+                        board = chess::Board::fromFen(fen);
+                    }
+
+                    if (arg == "moves") {
+                        while (args_stream >> arg) {
+                            board.makeMove(chess::uci::uciToMove(board, arg));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}